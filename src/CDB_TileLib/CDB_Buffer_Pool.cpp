@@ -0,0 +1,202 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Buffer_Pool"
+#include <stdlib.h>
+#include <new>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+//Four classes per power of two from 4 KB up to 112 MB, larger buffers are not pooled
+#define CDB_POOL_ALIGNMENT 64
+#define CDB_POOL_MIN_BYTES 4096
+#define CDB_POOL_MAX_BYTES (64 * 1024 * 1024)
+#define CDB_POOL_CLASSES 60
+
+//Sits in the alignment sized gap in front of every buffer
+struct CDB_Buffer_Header
+{
+	int		Class;
+	size_t	Bytes;
+};
+
+static OpenThreads::Mutex & Pool_Mutex(void)
+{
+	static OpenThreads::Mutex s_Pool_Mutex;
+	return s_Pool_Mutex;
+}
+
+//The pool state is only touched with the pool mutex held
+static std::vector<void *> s_Free_Buffers[CDB_POOL_CLASSES];
+static size_t s_Retained_Budget = 64 * 1024 * 1024;
+static size_t s_Retained_Bytes = 0;
+static size_t s_Peak_Retained_Bytes = 0;
+static unsigned long long s_Requests = 0;
+static unsigned long long s_Pool_Hits = 0;
+static unsigned long long s_System_Allocations = 0;
+static unsigned long long s_System_Frees = 0;
+
+static CDB_Buffer_Header * Header(void *Buffer)
+{
+	return (CDB_Buffer_Header *)((unsigned char *)Buffer - CDB_POOL_ALIGNMENT);
+}
+
+static int Size_Class(size_t Bytes, size_t &Class_Bytes)
+{
+	int cls = 0;
+	for (size_t p = CDB_POOL_MIN_BYTES; p <= CDB_POOL_MAX_BYTES; p *= 2)
+	{
+		for (size_t k = 0; k < 4; ++k)
+		{
+			size_t size = p + k * (p / 4);
+			if (Bytes <= size)
+			{
+				Class_Bytes = size;
+				return cls;
+			}
+			++cls;
+		}
+	}
+	Class_Bytes = (Bytes + CDB_POOL_ALIGNMENT - 1) & ~((size_t)CDB_POOL_ALIGNMENT - 1);
+	return -1;
+}
+
+//Counted by the caller under the pool mutex
+static void * System_Allocate(int Class, size_t Class_Bytes)
+{
+	void * base = NULL;
+#ifdef _MSC_VER
+	base = _aligned_malloc(Class_Bytes + CDB_POOL_ALIGNMENT, CDB_POOL_ALIGNMENT);
+#else
+	if (posix_memalign(&base, CDB_POOL_ALIGNMENT, Class_Bytes + CDB_POOL_ALIGNMENT) != 0)
+		base = NULL;
+#endif
+	if (!base)
+		throw std::bad_alloc();
+	CDB_Buffer_Header * header = (CDB_Buffer_Header *)base;
+	header->Class = Class;
+	header->Bytes = Class_Bytes;
+	return (unsigned char *)base + CDB_POOL_ALIGNMENT;
+}
+
+static void System_Free(void *Buffer)
+{
+#ifdef _MSC_VER
+	_aligned_free(Header(Buffer));
+#else
+	free(Header(Buffer));
+#endif
+}
+
+void * CDB_Buffer_Pool::Allocate(size_t Bytes)
+{
+	size_t class_bytes;
+	int cls = Size_Class(Bytes, class_bytes);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Pool_Mutex());
+		++s_Requests;
+		if (cls >= 0)
+		{
+			std::vector<void *> &free_buffers = s_Free_Buffers[cls];
+			if (!free_buffers.empty())
+			{
+				void * buffer = free_buffers.back();
+				free_buffers.pop_back();
+				s_Retained_Bytes -= class_bytes;
+				++s_Pool_Hits;
+				return buffer;
+			}
+		}
+		++s_System_Allocations;
+	}
+	return System_Allocate(cls, class_bytes);
+}
+
+void CDB_Buffer_Pool::Release(void *Buffer)
+{
+	if (!Buffer)
+		return;
+	CDB_Buffer_Header * header = Header(Buffer);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Pool_Mutex());
+		if ((header->Class >= 0) && (s_Retained_Bytes + header->Bytes <= s_Retained_Budget))
+		{
+			s_Free_Buffers[header->Class].push_back(Buffer);
+			s_Retained_Bytes += header->Bytes;
+			if (s_Retained_Bytes > s_Peak_Retained_Bytes)
+				s_Peak_Retained_Bytes = s_Retained_Bytes;
+			return;
+		}
+		++s_System_Frees;
+	}
+	System_Free(Buffer);
+}
+
+void CDB_Buffer_Pool::Set_Retained_Size(int MegaBytes)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Pool_Mutex());
+		s_Retained_Budget = (MegaBytes > 0) ? (size_t)MegaBytes * 1024 * 1024 : 0;
+	}
+	Trim();
+}
+
+void CDB_Buffer_Pool::Trim(void)
+{
+	std::vector<void *> freed;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Pool_Mutex());
+		for (int c = 0; c < CDB_POOL_CLASSES; ++c)
+		{
+			freed.insert(freed.end(), s_Free_Buffers[c].begin(), s_Free_Buffers[c].end());
+			s_Free_Buffers[c].clear();
+		}
+		s_Retained_Bytes = 0;
+		s_System_Frees += freed.size();
+	}
+	for (std::vector<void *>::iterator fi = freed.begin(); fi != freed.end(); ++fi)
+		System_Free(*fi);
+}
+
+void CDB_Buffer_Pool::Get_Counters(CDB_Buffer_Pool_Counters &Counters)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Pool_Mutex());
+	Counters.Requests = s_Requests;
+	Counters.Pool_Hits = s_Pool_Hits;
+	Counters.System_Allocations = s_System_Allocations;
+	Counters.System_Frees = s_System_Frees;
+	Counters.Retained_Bytes = s_Retained_Bytes;
+	Counters.Peak_Retained_Bytes = s_Peak_Retained_Bytes;
+}
+
+std::string CDB_Buffer_Pool::Get_Report(void)
+{
+	CDB_Buffer_Pool_Counters counters;
+	Get_Counters(counters);
+	std::stringstream buf;
+	buf << std::fixed << std::setprecision(1);
+	buf << "buffer pool: requests " << counters.Requests
+		<< " pool_hits " << counters.Pool_Hits << " system_allocs " << counters.System_Allocations
+		<< " system_frees " << counters.System_Frees
+		<< " retained_mb " << (double)counters.Retained_Bytes / (1024.0 * 1024.0)
+		<< " peak_retained_mb " << (double)counters.Peak_Retained_Bytes / (1024.0 * 1024.0) << std::endl;
+	return buf.str();
+}
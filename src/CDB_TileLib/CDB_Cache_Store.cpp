@@ -0,0 +1,469 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Cache_Store"
+#include <set>
+#include <string.h>
+#include <cpl_conv.h>
+#include <OpenThreads/ScopedLock>
+#include <osgDB/FileUtils>
+#include <osgEarth/Notify>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+//The file starts with a fixed header followed by the tile records
+#define CDB_STORE_FILE_MAGIC	"CDBPACK"
+#define CDB_STORE_VERSION		1
+//A record is written with the pending magic and only marked committed once
+//all of it is on disk, so readers never index a partially written record.
+#define CDB_STORE_RECORD_COMMITTED	"CDBR"
+#define CDB_STORE_RECORD_PENDING	"CDBW"
+
+#define CDB_STORE_ENCODING_RAW		0
+#define CDB_STORE_ENCODING_DEFLATE	1
+
+//Writers serialize on a lock of a byte far past the end of any store so the
+//lock never gets in the way of readers on Windows
+#define CDB_STORE_LOCK_OFFSET_HIGH	0x7FFFFFFF
+#define CDB_STORE_LOCK_OFFSET		((GIntBig)0x7FFFFFFF << 32)
+
+struct CDB_Store_File_Header
+{
+	char			Magic[8];
+	unsigned int	Version;
+	unsigned int	Record_Header_Size;
+};
+
+struct CDB_Store_Record_Header
+{
+	char			Magic[4];
+	unsigned int	Payload_Size;
+	unsigned int	Raw_Size;
+	unsigned int	Encoding;
+	int				Width;
+	int				Height;
+	int				Bands;
+	int				Data_Type;
+	double			GeoTransform[6];
+	char			Key[CDB_CACHE_STORE_KEY_SIZE];
+};
+
+static OpenThreads::Mutex s_StoreRegistryMutex;
+static std::set<std::string> s_PackedCacheDirs;
+static std::map<std::string, osg::ref_ptr<CDB_Cache_Store> > s_Stores;
+
+CDB_Cache_Store::CDB_Cache_Store(const std::string &FileName) : m_FileName(FileName), m_Open(false), m_End(0)
+{
+#ifdef _WIN32
+	m_Handle = INVALID_HANDLE_VALUE;
+#else
+	m_Handle = -1;
+#endif
+	m_Open = Open_File();
+}
+
+CDB_Cache_Store::~CDB_Cache_Store()
+{
+	Close_File();
+}
+
+bool CDB_Cache_Store::Is_Open(void)
+{
+	return m_Open;
+}
+
+bool CDB_Cache_Store::Open_File(void)
+{
+#ifdef _WIN32
+	m_Handle = ::CreateFileA(m_FileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+							 NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_Handle == INVALID_HANDLE_VALUE)
+		return false;
+#else
+	m_Handle = ::open(m_FileName.c_str(), O_RDWR | O_CREAT, 0666);
+	if (m_Handle < 0)
+		return false;
+#endif
+
+	//A new store gets its header from whichever process gets there first
+	if (!Lock_File())
+	{
+		Close_File();
+		return false;
+	}
+	bool valid = true;
+	CDB_Store_File_Header header;
+	if (File_Size() == 0)
+	{
+		memset(&header, 0, sizeof(header));
+		strncpy(header.Magic, CDB_STORE_FILE_MAGIC, sizeof(header.Magic));
+		header.Version = CDB_STORE_VERSION;
+		header.Record_Header_Size = sizeof(CDB_Store_Record_Header);
+		valid = Write_At(0, &header, sizeof(header));
+	}
+	else if (!Read_At(0, &header, sizeof(header)) || (strncmp(header.Magic, CDB_STORE_FILE_MAGIC, sizeof(header.Magic)) != 0) ||
+			 (header.Version != CDB_STORE_VERSION) || (header.Record_Header_Size != sizeof(CDB_Store_Record_Header)))
+	{
+		OE_WARN "CDB cache store " << m_FileName << " is not a compatible store" << std::endl;
+		valid = false;
+	}
+	Unlock_File();
+
+	if (!valid)
+	{
+		Close_File();
+		return false;
+	}
+
+	m_End = sizeof(CDB_Store_File_Header);
+	Scan();
+	return true;
+}
+
+void CDB_Cache_Store::Close_File(void)
+{
+#ifdef _WIN32
+	if (m_Handle != INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(m_Handle);
+		m_Handle = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (m_Handle >= 0)
+	{
+		::close(m_Handle);
+		m_Handle = -1;
+	}
+#endif
+	m_Open = false;
+}
+
+void CDB_Cache_Store::Scan(void)
+{
+	//Index every committed record from the current end of the index
+	GIntBig filesize = File_Size();
+	CDB_Store_Record_Header header;
+	while (m_End + (GIntBig)sizeof(header) <= filesize)
+	{
+		if (!Read_At(m_End, &header, sizeof(header)))
+			break;
+		if (strncmp(header.Magic, CDB_STORE_RECORD_COMMITTED, 4) != 0)
+			break;
+		GIntBig recordsize = (GIntBig)sizeof(header) + (GIntBig)header.Payload_Size;
+		if (m_End + recordsize > filesize)
+			break;
+
+		std::string key(header.Key, strnlen(header.Key, CDB_CACHE_STORE_KEY_SIZE));
+		Index_Entry entry;
+		entry.Offset = m_End;
+		entry.Record_Size = (unsigned)recordsize;
+		m_Index[key] = entry;
+		m_End += recordsize;
+	}
+}
+
+bool CDB_Cache_Store::Catch_Up(void)
+{
+	//Another process may have appended to the store since we last looked
+	if (File_Size() <= m_End)
+		return false;
+	OpenThreads::ScopedWriteLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+	GIntBig oldend = m_End;
+	Scan();
+	return m_End != oldend;
+}
+
+bool CDB_Cache_Store::Contains(const std::string &Key)
+{
+	if (!m_Open)
+		return false;
+	{
+		OpenThreads::ScopedReadLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+		if (m_Index.find(Key) != m_Index.end())
+			return true;
+	}
+	if (!Catch_Up())
+		return false;
+	OpenThreads::ScopedReadLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+	return m_Index.find(Key) != m_Index.end();
+}
+
+int CDB_Cache_Store::Tile_Count(void)
+{
+	OpenThreads::ScopedReadLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+	return (int)m_Index.size();
+}
+
+bool CDB_Cache_Store::Read(const std::string &Key, const CDB_Cache_Store_Tile &Expected, void *Buffer, size_t BufferSize, CDB_Cache_Store_Tile &Tile)
+{
+	if (!m_Open)
+		return false;
+
+	Index_Entry entry;
+	{
+		OpenThreads::ScopedReadLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+		Index_Map::iterator ii = m_Index.find(Key);
+		if (ii == m_Index.end())
+			return false;
+		entry = ii->second;
+	}
+
+	//The whole record comes in with one read
+	std::vector<char> record(entry.Record_Size);
+	if (!Read_At(entry.Offset, &record[0], entry.Record_Size))
+		return false;
+
+	CDB_Store_Record_Header header;
+	memcpy(&header, &record[0], sizeof(header));
+	if ((header.Width != Expected.Width) || (header.Height != Expected.Height) || (header.Bands != Expected.Bands) ||
+		(header.Data_Type != (int)Expected.Data_Type) || (header.Raw_Size != BufferSize))
+	{
+		OE_WARN "CDB cache store tile " << Key << " does not match the requested layout" << std::endl;
+		return false;
+	}
+
+	const char *payload = &record[sizeof(header)];
+	if (header.Encoding == CDB_STORE_ENCODING_DEFLATE)
+	{
+		size_t outsize = 0;
+		if (!CPLZLibInflate(payload, header.Payload_Size, Buffer, BufferSize, &outsize) || (outsize != BufferSize))
+			return false;
+	}
+	else
+	{
+		memcpy(Buffer, payload, BufferSize);
+	}
+
+	Tile.Width = header.Width;
+	Tile.Height = header.Height;
+	Tile.Bands = header.Bands;
+	Tile.Data_Type = (GDALDataType)header.Data_Type;
+	for (int i = 0; i < 6; ++i)
+		Tile.GeoTransform[i] = header.GeoTransform[i];
+	return true;
+}
+
+bool CDB_Cache_Store::Write(const std::string &Key, const CDB_Cache_Store_Tile &Tile, const void *Buffer, size_t BufferSize, bool Compress)
+{
+	if (!m_Open || (Key.size() > CDB_CACHE_STORE_KEY_SIZE))
+		return false;
+
+	CDB_Store_Record_Header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.Magic, CDB_STORE_RECORD_PENDING, 4);
+	header.Raw_Size = (unsigned)BufferSize;
+	header.Encoding = CDB_STORE_ENCODING_RAW;
+	header.Width = Tile.Width;
+	header.Height = Tile.Height;
+	header.Bands = Tile.Bands;
+	header.Data_Type = (int)Tile.Data_Type;
+	for (int i = 0; i < 6; ++i)
+		header.GeoTransform[i] = Tile.GeoTransform[i];
+	memcpy(header.Key, Key.c_str(), Key.size());
+
+	const void *payload = Buffer;
+	size_t payloadsize = BufferSize;
+	void *compressed = NULL;
+	if (Compress)
+	{
+		size_t outsize = 0;
+		compressed = CPLZLibDeflate(Buffer, BufferSize, -1, NULL, 0, &outsize);
+		if (compressed && (outsize < BufferSize))
+		{
+			payload = compressed;
+			payloadsize = outsize;
+			header.Encoding = CDB_STORE_ENCODING_DEFLATE;
+		}
+	}
+	header.Payload_Size = (unsigned)payloadsize;
+
+	std::vector<char> record(sizeof(header) + payloadsize);
+	memcpy(&record[0], &header, sizeof(header));
+	memcpy(&record[sizeof(header)], payload, payloadsize);
+	if (compressed)
+		CPLFree(compressed);
+
+	//One writer at a time, in this process and across processes
+	OpenThreads::ScopedLock<OpenThreads::Mutex> writelock(m_WriteMutex);
+	if (!Lock_File())
+		return false;
+
+	Catch_Up();
+	GIntBig offset = m_End;
+	bool ok = Write_At(offset, &record[0], record.size());
+	if (ok)
+		ok = Write_At(offset, CDB_STORE_RECORD_COMMITTED, 4);
+
+	if (ok)
+	{
+		OpenThreads::ScopedWriteLock<OpenThreads::ReadWriteMutex> lock(m_IndexMutex);
+		Index_Entry entry;
+		entry.Offset = offset;
+		entry.Record_Size = (unsigned)record.size();
+		m_Index[Key] = entry;
+		m_End = offset + (GIntBig)record.size();
+	}
+	Unlock_File();
+	return ok;
+}
+
+GIntBig CDB_Cache_Store::File_Size(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	if (!::GetFileSizeEx(m_Handle, &size))
+		return 0;
+	return (GIntBig)size.QuadPart;
+#else
+	struct stat st;
+	if (::fstat(m_Handle, &st) != 0)
+		return 0;
+	return (GIntBig)st.st_size;
+#endif
+}
+
+bool CDB_Cache_Store::Read_At(GIntBig Offset, void *Buffer, size_t Size)
+{
+#ifdef _WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)(Offset & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(Offset >> 32);
+	DWORD got = 0;
+	if (!::ReadFile(m_Handle, Buffer, (DWORD)Size, &got, &ov))
+		return false;
+	return got == (DWORD)Size;
+#else
+	char *dst = (char *)Buffer;
+	while (Size > 0)
+	{
+		ssize_t got = ::pread(m_Handle, dst, Size, (off_t)Offset);
+		if (got <= 0)
+			return false;
+		dst += got;
+		Offset += got;
+		Size -= (size_t)got;
+	}
+	return true;
+#endif
+}
+
+bool CDB_Cache_Store::Write_At(GIntBig Offset, const void *Buffer, size_t Size)
+{
+#ifdef _WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)(Offset & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(Offset >> 32);
+	DWORD put = 0;
+	if (!::WriteFile(m_Handle, Buffer, (DWORD)Size, &put, &ov))
+		return false;
+	return put == (DWORD)Size;
+#else
+	const char *src = (const char *)Buffer;
+	while (Size > 0)
+	{
+		ssize_t put = ::pwrite(m_Handle, src, Size, (off_t)Offset);
+		if (put <= 0)
+			return false;
+		src += put;
+		Offset += put;
+		Size -= (size_t)put;
+	}
+	return true;
+#endif
+}
+
+bool CDB_Cache_Store::Lock_File(void)
+{
+#ifdef _WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.OffsetHigh = CDB_STORE_LOCK_OFFSET_HIGH;
+	return ::LockFileEx(m_Handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov) != 0;
+#else
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)CDB_STORE_LOCK_OFFSET;
+	fl.l_len = 1;
+	while (::fcntl(m_Handle, F_SETLKW, &fl) != 0)
+	{
+		if (errno != EINTR)
+			return false;
+	}
+	return true;
+#endif
+}
+
+void CDB_Cache_Store::Unlock_File(void)
+{
+#ifdef _WIN32
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.OffsetHigh = CDB_STORE_LOCK_OFFSET_HIGH;
+	::UnlockFileEx(m_Handle, 0, 1, 0, &ov);
+#else
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)CDB_STORE_LOCK_OFFSET;
+	fl.l_len = 1;
+	::fcntl(m_Handle, F_SETLK, &fl);
+#endif
+}
+
+void CDB_Cache_Store::Use_Packed_Cache(const std::string &CacheDir)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_StoreRegistryMutex);
+	s_PackedCacheDirs.insert(CacheDir);
+}
+
+CDB_Cache_Store * CDB_Cache_Store::Find(const std::string &CacheDir, const std::string &LayerName, const std::string &DataSet)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_StoreRegistryMutex);
+	if (s_PackedCacheDirs.find(CacheDir) == s_PackedCacheDirs.end())
+		return NULL;
+
+	//One store per layer and dataset i.e. 004_Imagery/D004_S001_T001.cdbpack
+	std::string name = DataSet;
+	while (!name.empty() && (name[0] == '_'))
+		name.erase(0, 1);
+	while (!name.empty() && (name[name.size() - 1] == '_'))
+		name.erase(name.size() - 1);
+	std::string layerdir = CacheDir + "/" + LayerName;
+	std::string filename = layerdir + "/" + name + ".cdbpack";
+
+	std::map<std::string, osg::ref_ptr<CDB_Cache_Store> >::iterator si = s_Stores.find(filename);
+	if (si == s_Stores.end())
+	{
+		osgDB::makeDirectory(layerdir);
+		osg::ref_ptr<CDB_Cache_Store> store = new CDB_Cache_Store(filename);
+		if (!store->Is_Open())
+			OE_WARN "CDB unable to open cache store " << filename << std::endl;
+		si = s_Stores.insert(std::make_pair(filename, store)).first;
+	}
+	return si->second->Is_Open() ? si->second.get() : NULL;
+}
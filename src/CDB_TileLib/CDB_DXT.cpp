@@ -0,0 +1,279 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_DXT"
+#include <osg/Texture>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define CDB_DXT_SSE2
+#include <emmintrin.h>
+#endif
+
+static inline unsigned short To_565(const unsigned char *Rgb)
+{
+	return (unsigned short)(((Rgb[0] >> 3) << 11) | ((Rgb[1] >> 2) << 5) | (Rgb[2] >> 3));
+}
+
+static inline void From_565(unsigned short Color, int *Rgb)
+{
+	int r = (Color >> 11) & 31;
+	int g = (Color >> 5) & 63;
+	int b = Color & 31;
+	Rgb[0] = (r << 3) | (r >> 2);
+	Rgb[1] = (g << 2) | (g >> 4);
+	Rgb[2] = (b << 3) | (b >> 2);
+}
+
+//Per channel minimum and maximum of the 16 pixels of a block
+static void Block_Bounds(const unsigned char *Rgba, unsigned char *Min, unsigned char *Max)
+{
+#ifdef CDB_DXT_SSE2
+	__m128i p0 = _mm_loadu_si128((const __m128i *)(Rgba));
+	__m128i p1 = _mm_loadu_si128((const __m128i *)(Rgba + 16));
+	__m128i p2 = _mm_loadu_si128((const __m128i *)(Rgba + 32));
+	__m128i p3 = _mm_loadu_si128((const __m128i *)(Rgba + 48));
+	__m128i mn = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+	__m128i mx = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+	mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+	mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+	mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+	mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+	int imn = _mm_cvtsi128_si32(mn);
+	int imx = _mm_cvtsi128_si32(mx);
+	memcpy(Min, &imn, 3);
+	memcpy(Max, &imx, 3);
+#else
+	for (int c = 0; c < 3; ++c)
+	{
+		Min[c] = Max[c] = Rgba[c];
+		for (int i = 1; i < 16; ++i)
+		{
+			unsigned char v = Rgba[i * 4 + c];
+			if (v < Min[c])
+				Min[c] = v;
+			if (v > Max[c])
+				Max[c] = v;
+		}
+	}
+#endif
+}
+
+void CDB_DXT::Encode_Block(const unsigned char *Rgba, unsigned char *Block)
+{
+	unsigned char mn[4], mx[4];
+	Block_Bounds(Rgba, mn, mx);
+
+	//Pull the end points in a little, the box corners are rarely in the block
+	for (int c = 0; c < 3; ++c)
+	{
+		int inset = (mx[c] - mn[c]) >> 4;
+		mn[c] = (unsigned char)(mn[c] + inset);
+		mx[c] = (unsigned char)(mx[c] - inset);
+	}
+
+	unsigned short c0 = To_565(mx);
+	unsigned short c1 = To_565(mn);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	unsigned int indices = 0;
+	if (c0 != c1)
+	{
+		//c0 > c1 selects the four colour mode
+		int palette[4][3];
+		From_565(c0, palette[0]);
+		From_565(c1, palette[1]);
+		for (int c = 0; c < 3; ++c)
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		for (int i = 0; i < 16; ++i)
+		{
+			const unsigned char *p = Rgba + i * 4;
+			int best = 0;
+			int bestDist = 0x7fffffff;
+			for (int e = 0; e < 4; ++e)
+			{
+				int dr = p[0] - palette[e][0];
+				int dg = p[1] - palette[e][1];
+				int db = p[2] - palette[e][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (dist < bestDist)
+				{
+					bestDist = dist;
+					best = e;
+				}
+			}
+			indices |= (unsigned int)best << (2 * i);
+		}
+	}
+
+	Block[0] = (unsigned char)(c0 & 0xff);
+	Block[1] = (unsigned char)(c0 >> 8);
+	Block[2] = (unsigned char)(c1 & 0xff);
+	Block[3] = (unsigned char)(c1 >> 8);
+	Block[4] = (unsigned char)(indices & 0xff);
+	Block[5] = (unsigned char)((indices >> 8) & 0xff);
+	Block[6] = (unsigned char)((indices >> 16) & 0xff);
+	Block[7] = (unsigned char)(indices >> 24);
+}
+
+void CDB_DXT::Decode_Block(const unsigned char *Block, unsigned char *Rgba)
+{
+	unsigned short c0 = (unsigned short)(Block[0] | (Block[1] << 8));
+	unsigned short c1 = (unsigned short)(Block[2] | (Block[3] << 8));
+	unsigned int indices = (unsigned int)Block[4] | ((unsigned int)Block[5] << 8) | ((unsigned int)Block[6] << 16) | ((unsigned int)Block[7] << 24);
+
+	int palette[4][4];
+	From_565(c0, palette[0]);
+	From_565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = palette[2][3] = 255;
+	palette[3][3] = 255;
+	for (int c = 0; c < 3; ++c)
+	{
+		if (c0 > c1)
+		{
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+		else
+		{
+			palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+			palette[3][c] = 0;
+		}
+	}
+	if (c0 <= c1)
+		palette[3][3] = 0;
+
+	for (int i = 0; i < 16; ++i)
+	{
+		int e = (indices >> (2 * i)) & 3;
+		for (int c = 0; c < 4; ++c)
+			Rgba[i * 4 + c] = (unsigned char)palette[e][c];
+	}
+}
+
+//Compresses one RGBA level, blocks past the edge of levels smaller than 4 repeat the edge
+static void Encode_Level(const unsigned char *Rgba, int Width, int Height, unsigned char *Out)
+{
+	unsigned char block[64];
+	for (int by = 0; by < Height; by += 4)
+	{
+		for (int bx = 0; bx < Width; bx += 4)
+		{
+			for (int y = 0; y < 4; ++y)
+			{
+				int sy = std::min(by + y, Height - 1);
+				for (int x = 0; x < 4; ++x)
+				{
+					int sx = std::min(bx + x, Width - 1);
+					memcpy(block + (y * 4 + x) * 4, Rgba + ((size_t)sy * Width + sx) * 4, 4);
+				}
+			}
+			CDB_DXT::Encode_Block(block, Out);
+			Out += 8;
+		}
+	}
+}
+
+osg::Image * CDB_DXT::Compress_RGB(const unsigned char *Red, const unsigned char *Green, const unsigned char *Blue,
+								   int Width, int Height, bool Mipmaps)
+{
+	if ((Width <= 0) || (Height <= 0) || (Width % 4) || (Height % 4))
+		return NULL;
+
+	//Level sizes and where each starts in the compressed data
+	std::vector<int> widths;
+	std::vector<int> heights;
+	std::vector<unsigned int> offsets;
+	size_t total = 0;
+	int w = Width;
+	int h = Height;
+	while (true)
+	{
+		widths.push_back(w);
+		heights.push_back(h);
+		offsets.push_back((unsigned int)total);
+		total += (size_t)((w + 3) / 4) * (size_t)((h + 3) / 4) * 8;
+		if (!Mipmaps || ((w == 1) && (h == 1)))
+			break;
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+	}
+
+	//Level 0 as RGBA, bottom row first
+	std::vector<unsigned char> level((size_t)Width * (size_t)Height * 4);
+	for (int y = 0; y < Height; ++y)
+	{
+		size_t src = (size_t)(Height - y - 1) * Width;
+		unsigned char *dst = &level[(size_t)y * Width * 4];
+		for (int x = 0; x < Width; ++x)
+		{
+			dst[0] = Red[src + x];
+			dst[1] = Green[src + x];
+			dst[2] = Blue[src + x];
+			dst[3] = 255;
+			dst += 4;
+		}
+	}
+
+	unsigned char *data = new unsigned char[total];
+	std::vector<unsigned char> next;
+	for (size_t l = 0; l < widths.size(); ++l)
+	{
+		if (l > 0)
+		{
+			//2x2 box filter of the level above
+			int pw = widths[l - 1];
+			int ph = heights[l - 1];
+			int nw = widths[l];
+			int nh = heights[l];
+			next.resize((size_t)nw * (size_t)nh * 4);
+			for (int y = 0; y < nh; ++y)
+			{
+				int y0 = std::min(2 * y, ph - 1);
+				int y1 = std::min(2 * y + 1, ph - 1);
+				for (int x = 0; x < nw; ++x)
+				{
+					int x0 = std::min(2 * x, pw - 1);
+					int x1 = std::min(2 * x + 1, pw - 1);
+					const unsigned char *a = &level[((size_t)y0 * pw + x0) * 4];
+					const unsigned char *b = &level[((size_t)y0 * pw + x1) * 4];
+					const unsigned char *c = &level[((size_t)y1 * pw + x0) * 4];
+					const unsigned char *d = &level[((size_t)y1 * pw + x1) * 4];
+					unsigned char *o = &next[((size_t)y * nw + x) * 4];
+					for (int ch = 0; ch < 4; ++ch)
+						o[ch] = (unsigned char)((a[ch] + b[ch] + c[ch] + d[ch] + 2) >> 2);
+				}
+			}
+			level.swap(next);
+		}
+		Encode_Level(&level[0], widths[l], heights[l], data + offsets[l]);
+	}
+
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->setImage(Width, Height, 1, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_UNSIGNED_BYTE,
+					data, osg::Image::USE_NEW_DELETE);
+	if (offsets.size() > 1)
+	{
+		osg::Image::MipmapDataType mipmaps(offsets.begin() + 1, offsets.end());
+		image->setMipmapLevels(mipmaps);
+	}
+	return image.release();
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Elevation_Sampler"
+#include <math.h>
+#include <map>
+#include <algorithm>
+
+//The highest CDB lod
+#define CDB_SAMPLER_MAX_LOD 23
+
+//A CDB tile: its geocell and the tile's row (up) and column (right) in the geocell
+struct CDB_Sample_Key
+{
+	int	Lat;
+	int	Lon;
+	int	Up;
+	int	Right;
+
+	bool operator<(const CDB_Sample_Key &Other) const
+	{
+		if (Lat != Other.Lat)
+			return Lat < Other.Lat;
+		if (Lon != Other.Lon)
+			return Lon < Other.Lon;
+		if (Up != Other.Up)
+			return Up < Other.Up;
+		return Right < Other.Right;
+	}
+};
+typedef std::map<CDB_Sample_Key, std::vector<size_t> > CDB_Sample_BucketMap;
+
+static CDB_Sample_Key Sample_Key(const coord2d &Point, int Lod)
+{
+	//Points on the north pole or the antimeridian belong to the tiles below and left of them
+	double lat = std::min(std::max(Point.Ypos, -90.0), 90.0 - 1e-9);
+	double lon = std::min(std::max(Point.Xpos, -180.0), 180.0 - 1e-9);
+	int tiles = 1 << Lod;
+
+	CDB_Sample_Key key;
+	key.Lat = (int)floor(lat);
+	double lon_step = CDB_Tile::Get_Lon_Step((double)key.Lat);
+	key.Lon = (int)(floor(lon / lon_step) * lon_step);
+	key.Up = std::min((int)floor((lat - (double)key.Lat) * (double)tiles), tiles - 1);
+	key.Right = std::min((int)floor((lon - (double)key.Lon) / lon_step * (double)tiles), tiles - 1);
+	return key;
+}
+
+static CDB_Tile_Extent Key_Extent(const CDB_Sample_Key &Key, int Lod)
+{
+	double tiles = (double)(1 << Lod);
+	double lon_step = CDB_Tile::Get_Lon_Step((double)Key.Lat);
+	CDB_Tile_Extent extent;
+	extent.South = (double)Key.Lat + (double)Key.Up / tiles;
+	extent.North = (double)Key.Lat + (double)(Key.Up + 1) / tiles;
+	extent.West = (double)Key.Lon + (double)Key.Right * lon_step / tiles;
+	extent.East = (double)Key.Lon + (double)(Key.Right + 1) * lon_step / tiles;
+	return extent;
+}
+
+CDB_Elevation_Sampler::CDB_Elevation_Sampler(std::string cdbRootDir, std::string dataset) : m_cdbRootDir(cdbRootDir), m_DataSet(dataset)
+{
+}
+
+CDB_Tile_Extent CDB_Elevation_Sampler::Tile_Extent(const coord2d &Point, int Lod)
+{
+	Lod = std::min(std::max(Lod, 0), CDB_SAMPLER_MAX_LOD);
+	return Key_Extent(Sample_Key(Point, Lod), Lod);
+}
+
+bool CDB_Elevation_Sampler::Sample(const std::vector<coord2d> &Points, int Lod, std::vector<float> &Heights,
+								   osgEarth::ProgressCallback *progress)
+{
+	Heights.assign(Points.size(), NO_DATA_VALUE);
+	//Negative lods only exist in the driver caches
+	Lod = std::min(std::max(Lod, 0), CDB_SAMPLER_MAX_LOD);
+
+	std::vector<size_t> pending;
+	pending.reserve(Points.size());
+	for (size_t i = 0; i < Points.size(); ++i)
+	{
+		if ((Points[i].Ypos >= -90.0) && (Points[i].Ypos <= 90.0) && (Points[i].Xpos >= -180.0) && (Points[i].Xpos <= 180.0))
+			pending.push_back(i);
+	}
+
+	std::vector<coord2d> tilePoints;
+	std::vector<float> tileHeights;
+	//Points without a height at one lod are tried again in the tile a lod coarser
+	for (int lod = Lod; (lod >= 0) && !pending.empty(); --lod)
+	{
+		CDB_Sample_BucketMap buckets;
+		for (std::vector<size_t>::iterator pi = pending.begin(); pi != pending.end(); ++pi)
+			buckets[Sample_Key(Points[*pi], lod)].push_back(*pi);
+		pending.clear();
+
+		for (CDB_Sample_BucketMap::iterator bi = buckets.begin(); bi != buckets.end(); ++bi)
+		{
+			if (CDB_Tile::Is_Cancelled(progress))
+				return false;
+
+			std::vector<size_t> &indices = bi->second;
+			CDB_Tile_Extent extent = Key_Extent(bi->first, lod);
+			CDB_Tile tile(m_cdbRootDir, "", Elevation, m_DataSet, &extent);
+			if (!tile.Tile_Exists() || !tile.Load_Decoded_Tile(progress))
+			{
+				pending.insert(pending.end(), indices.begin(), indices.end());
+				continue;
+			}
+
+			tilePoints.resize(indices.size());
+			tileHeights.resize(indices.size());
+			for (size_t k = 0; k < indices.size(); ++k)
+				tilePoints[k] = Points[indices[k]];
+			tile.Get_Elevations(&tilePoints[0], tilePoints.size(), &tileHeights[0]);
+			for (size_t k = 0; k < indices.size(); ++k)
+			{
+				if (tileHeights[k] == NO_DATA_VALUE)
+					pending.push_back(indices[k]);
+				else
+					Heights[indices[k]] = tileHeights[k];
+			}
+		}
+	}
+	return true;
+}
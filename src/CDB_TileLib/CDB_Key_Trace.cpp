@@ -0,0 +1,104 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Key_Trace"
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <osgEarth/Notify>
+
+static OpenThreads::Mutex s_Trace_Mutex;
+static FILE * s_Trace_File = NULL;
+static std::string s_Trace_Name = "";
+static osg::Timer_t s_Trace_Start = 0;
+static volatile bool s_Trace_Open = false;
+
+bool CDB_Key_Trace::Open(const std::string &FileName)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Trace_Mutex);
+	//Several layers name the same file
+	if (s_Trace_File && (s_Trace_Name == FileName))
+		return true;
+	if (s_Trace_File)
+		fclose(s_Trace_File);
+
+	s_Trace_File = fopen(FileName.c_str(), "w");
+	if (!s_Trace_File)
+	{
+		OE_WARN "CDB unable to open key trace " << FileName << std::endl;
+		s_Trace_Open = false;
+		return false;
+	}
+	fprintf(s_Trace_File, "# kind lod x y seconds\n");
+	s_Trace_Name = FileName;
+	s_Trace_Start = osg::Timer::instance()->tick();
+	s_Trace_Open = true;
+	return true;
+}
+
+bool CDB_Key_Trace::Is_Open(void)
+{
+	return s_Trace_Open;
+}
+
+void CDB_Key_Trace::Record(const char *Kind, unsigned Lod, unsigned X, unsigned Y)
+{
+	if (!s_Trace_Open)
+		return;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Trace_Mutex);
+	if (!s_Trace_File)
+		return;
+	double secs = osg::Timer::instance()->delta_s(s_Trace_Start, osg::Timer::instance()->tick());
+	fprintf(s_Trace_File, "%s %u %u %u %.6f\n", Kind, Lod, X, Y, secs);
+	fflush(s_Trace_File);
+}
+
+void CDB_Key_Trace::Close(void)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Trace_Mutex);
+	if (s_Trace_File)
+		fclose(s_Trace_File);
+	s_Trace_File = NULL;
+	s_Trace_Name = "";
+	s_Trace_Open = false;
+}
+
+bool CDB_Key_Trace::Load(const std::string &FileName, CDB_Key_Trace_Entries &Entries)
+{
+	std::ifstream in(FileName.c_str());
+	if (!in)
+		return false;
+
+	Entries.clear();
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || (line[0] == '#'))
+			continue;
+		std::istringstream fields(line);
+		CDB_Key_Trace_Entry entry;
+		entry.Secs = 0.0;
+		if (!(fields >> entry.Kind >> entry.Lod >> entry.X >> entry.Y))
+			continue;
+		double secs;
+		if (fields >> secs)
+			entry.Secs = secs;
+		Entries.push_back(entry);
+	}
+	return true;
+}
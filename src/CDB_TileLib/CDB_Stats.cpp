@@ -0,0 +1,272 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Stats"
+#include "CDB_Buffer_Pool"
+#include <math.h>
+#include <string.h>
+#include <sstream>
+#include <iomanip>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <osgEarth/Notify>
+
+#ifdef _MSC_VER
+#define CDB_STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define CDB_STATS_THREAD_LOCAL __thread
+#endif
+
+//Two buckets per power of two starting at one microsecond.
+//Bucket zero holds everything under a microsecond and the last
+//bucket everything over about 16 seconds.
+#define CDB_STATS_BUCKETS 50
+#define CDB_STATS_LODS (CDB_STATS_MAX_LOD - CDB_STATS_MIN_LOD + 1)
+
+struct CDB_Stats_Histogram
+{
+	unsigned	Buckets[CDB_STATS_BUCKETS];
+	unsigned	Count;
+	double		Total_Secs;
+	double		Max_Secs;
+};
+
+//Only the owning thread writes to its block. Readers may see a record
+//that is part way through being added, which is close enough for stats.
+struct CDB_Stats_Thread_Block
+{
+	CDB_Stats_Histogram	Hist[CDB_Stat_Phase_Count][CDB_STATS_LODS];
+};
+typedef std::vector<CDB_Stats_Thread_Block *> CDB_Stats_Block_List;
+
+static CDB_STATS_THREAD_LOCAL CDB_Stats_Thread_Block * t_Block = NULL;
+static volatile bool s_Enabled = false;
+static double s_Dump_Interval = 0.0;
+static double s_Last_Dump = 0.0;
+static OpenThreads::Mutex s_Dump_Mutex;
+
+//Blocks outlive their threads so the time recorded by threads that have
+//gone away still shows up in the report.
+static OpenThreads::Mutex & Block_Mutex(void)
+{
+	static OpenThreads::Mutex s_Block_Mutex;
+	return s_Block_Mutex;
+}
+
+static CDB_Stats_Block_List & Block_List(void)
+{
+	static CDB_Stats_Block_List s_Blocks;
+	return s_Blocks;
+}
+
+static CDB_Stats_Thread_Block * Thread_Block(void)
+{
+	if (!t_Block)
+	{
+		CDB_Stats_Thread_Block * block = new CDB_Stats_Thread_Block;
+		memset(block, 0, sizeof(CDB_Stats_Thread_Block));
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Block_Mutex());
+		Block_List().push_back(block);
+		t_Block = block;
+	}
+	return t_Block;
+}
+
+static int Bucket_Index(double Secs)
+{
+	double usecs = Secs * 1000000.0;
+	if (usecs < 1.0)
+		return 0;
+	int exp;
+	double mant = frexp(usecs, &exp);
+	//usecs = mant * 2^exp with mant in [0.5, 1)
+	int index = 2 * (exp - 1) + ((mant >= 0.70710678) ? 2 : 1);
+	if (index >= CDB_STATS_BUCKETS)
+		index = CDB_STATS_BUCKETS - 1;
+	return index;
+}
+
+//The geometric middle of the bucket in milliseconds
+static double Bucket_Value_ms(int Index)
+{
+	if (Index == 0)
+		return 0.0005;
+	return pow(2.0, ((double)Index - 0.5) / 2.0) / 1000.0;
+}
+
+static int Lod_Slot(int Lod)
+{
+	if (Lod < CDB_STATS_MIN_LOD)
+		Lod = CDB_STATS_MIN_LOD;
+	else if (Lod > CDB_STATS_MAX_LOD)
+		Lod = CDB_STATS_MAX_LOD;
+	return Lod - CDB_STATS_MIN_LOD;
+}
+
+static double Percentile_ms(const CDB_Stats_Histogram &Hist, double Fraction)
+{
+	unsigned target = (unsigned)ceil(Fraction * (double)Hist.Count);
+	if (target < 1)
+		target = 1;
+	unsigned seen = 0;
+	for (int b = 0; b < CDB_STATS_BUCKETS; ++b)
+	{
+		seen += Hist.Buckets[b];
+		if (seen >= target)
+		{
+			double value = Bucket_Value_ms(b);
+			double max_ms = Hist.Max_Secs * 1000.0;
+			return (value > max_ms) ? max_ms : value;
+		}
+	}
+	return Hist.Max_Secs * 1000.0;
+}
+
+void CDB_Stats::Set_Enabled(bool Enabled)
+{
+	s_Enabled = Enabled;
+}
+
+bool CDB_Stats::Is_Enabled(void)
+{
+	return s_Enabled;
+}
+
+void CDB_Stats::Set_Dump_Interval(double Secs)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Dump_Mutex);
+	s_Dump_Interval = Secs;
+	s_Last_Dump = osg::Timer::instance()->time_s();
+}
+
+void CDB_Stats::Record(CDB_Stat_Phase Phase, int Lod, double Secs)
+{
+	if (!s_Enabled || (Phase < 0) || (Phase >= CDB_Stat_Phase_Count))
+		return;
+
+	CDB_Stats_Histogram &Hist = Thread_Block()->Hist[Phase][Lod_Slot(Lod)];
+	++Hist.Buckets[Bucket_Index(Secs)];
+	++Hist.Count;
+	Hist.Total_Secs += Secs;
+	if (Secs > Hist.Max_Secs)
+		Hist.Max_Secs = Secs;
+
+	if (s_Dump_Interval > 0.0)
+		Dump_If_Due();
+}
+
+void CDB_Stats::Dump_If_Due(void)
+{
+	double now = osg::Timer::instance()->time_s();
+	if (now - s_Last_Dump < s_Dump_Interval)
+		return;
+
+	//Another thread is already writing the report
+	if (s_Dump_Mutex.trylock() != 0)
+		return;
+	if ((s_Dump_Interval > 0.0) && (now - s_Last_Dump >= s_Dump_Interval))
+	{
+		s_Last_Dump = now;
+		OE_NOTICE "CDB request latency" << std::endl << Get_Report() << CDB_Buffer_Pool::Get_Report() << std::endl;
+	}
+	s_Dump_Mutex.unlock();
+}
+
+void CDB_Stats::Get_Summary(std::vector<CDB_Stats_Summary> &Summary)
+{
+	Summary.clear();
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Block_Mutex());
+	CDB_Stats_Block_List &blocks = Block_List();
+	for (int p = 0; p < CDB_Stat_Phase_Count; ++p)
+	{
+		for (int l = 0; l < CDB_STATS_LODS; ++l)
+		{
+			CDB_Stats_Histogram merged;
+			memset(&merged, 0, sizeof(CDB_Stats_Histogram));
+			for (CDB_Stats_Block_List::iterator bi = blocks.begin(); bi != blocks.end(); ++bi)
+			{
+				const CDB_Stats_Histogram &Hist = (*bi)->Hist[p][l];
+				if (Hist.Count == 0)
+					continue;
+				for (int b = 0; b < CDB_STATS_BUCKETS; ++b)
+					merged.Buckets[b] += Hist.Buckets[b];
+				merged.Count += Hist.Count;
+				merged.Total_Secs += Hist.Total_Secs;
+				if (Hist.Max_Secs > merged.Max_Secs)
+					merged.Max_Secs = Hist.Max_Secs;
+			}
+			if (merged.Count == 0)
+				continue;
+
+			CDB_Stats_Summary entry;
+			entry.Phase = (CDB_Stat_Phase)p;
+			entry.Lod = l + CDB_STATS_MIN_LOD;
+			entry.Count = merged.Count;
+			entry.Mean_ms = (merged.Total_Secs * 1000.0) / (double)merged.Count;
+			entry.P50_ms = Percentile_ms(merged, 0.50);
+			entry.P95_ms = Percentile_ms(merged, 0.95);
+			entry.P99_ms = Percentile_ms(merged, 0.99);
+			entry.Max_ms = merged.Max_Secs * 1000.0;
+			Summary.push_back(entry);
+		}
+	}
+}
+
+std::string CDB_Stats::Get_Report(void)
+{
+	std::vector<CDB_Stats_Summary> Summary;
+	Get_Summary(Summary);
+
+	std::stringstream buf;
+	buf << std::left << std::setw(20) << "phase" << std::right << std::setw(5) << "lod" << std::setw(10) << "count"
+		<< std::setw(11) << "mean_ms" << std::setw(11) << "p50_ms" << std::setw(11) << "p95_ms"
+		<< std::setw(11) << "p99_ms" << std::setw(11) << "max_ms" << std::endl;
+	buf << std::fixed << std::setprecision(3);
+	for (std::vector<CDB_Stats_Summary>::iterator si = Summary.begin(); si != Summary.end(); ++si)
+	{
+		buf << std::left << std::setw(20) << Phase_Name(si->Phase) << std::right << std::setw(5) << si->Lod << std::setw(10) << si->Count
+			<< std::setw(11) << si->Mean_ms << std::setw(11) << si->P50_ms << std::setw(11) << si->P95_ms
+			<< std::setw(11) << si->P99_ms << std::setw(11) << si->Max_ms << std::endl;
+	}
+	return buf.str();
+}
+
+void CDB_Stats::Reset(void)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(Block_Mutex());
+	CDB_Stats_Block_List &blocks = Block_List();
+	for (CDB_Stats_Block_List::iterator bi = blocks.begin(); bi != blocks.end(); ++bi)
+		memset(*bi, 0, sizeof(CDB_Stats_Thread_Block));
+}
+
+const char * CDB_Stats::Phase_Name(CDB_Stat_Phase Phase)
+{
+	switch (Phase)
+	{
+	case CDB_Stat_Image_Request:		return "image_request";
+	case CDB_Stat_HeightField_Request:	return "heightfield_request";
+	case CDB_Stat_Feature_Cursor:		return "feature_cursor";
+	case CDB_Stat_Get_Features:			return "get_features";
+	case CDB_Stat_Path_Probe:			return "path_probe";
+	case CDB_Stat_GDAL_Open:			return "gdal_open";
+	case CDB_Stat_Decode:				return "decode";
+	case CDB_Stat_Resample:				return "resample";
+	case CDB_Stat_Convert:				return "convert";
+	case CDB_Stat_Cache_Write:			return "cache_write";
+	case CDB_Stat_OGR_Iterate:			return "ogr_iterate";
+	case CDB_Stat_Archive_List:			return "archive_list";
+	default:							return "unknown";
+	}
+}
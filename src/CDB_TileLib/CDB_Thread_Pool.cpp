@@ -0,0 +1,139 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+
+// CDB_Tile is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// CDB_Tile is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// You should have received a copy of the GNU Lesser General Public License
+// along with CDB_Tile.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "CDB_Thread_Pool"
+
+class CDB_Thread_Pool_Worker : public OpenThreads::Thread
+{
+public:
+	CDB_Thread_Pool_Worker(CDB_Thread_Pool * Pool) : m_Pool(Pool)
+	{
+	}
+
+	virtual void run(void)
+	{
+		osg::ref_ptr<CDB_Thread_Task> Task;
+		while (m_Pool->Next_Task(Task))
+		{
+			Task->Run();
+			Task = NULL;
+		}
+	}
+
+private:
+	CDB_Thread_Pool *	m_Pool;
+};
+
+CDB_Thread_Task::CDB_Thread_Task() : m_Cancelled(false)
+{
+}
+
+CDB_Thread_Task::~CDB_Thread_Task()
+{
+}
+
+bool CDB_Thread_Task::Is_Cancelled(void)
+{
+	return m_Cancelled;
+}
+
+void CDB_Thread_Task::Cancel(void)
+{
+	m_Cancelled = true;
+}
+
+CDB_Thread_Pool::CDB_Thread_Pool(int NumThreads) : m_Done(false)
+{
+	if (NumThreads < 1)
+		NumThreads = 1;
+
+	for (int i = 0; i < NumThreads; ++i)
+	{
+		CDB_Thread_Pool_Worker * Worker = new CDB_Thread_Pool_Worker(this);
+		m_Workers.push_back(Worker);
+		Worker->start();
+	}
+}
+
+CDB_Thread_Pool::~CDB_Thread_Pool()
+{
+	Shutdown();
+}
+
+bool CDB_Thread_Pool::Add_Task(CDB_Thread_Task * Task)
+{
+	if (!Task)
+		return false;
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+	if (m_Done)
+		return false;
+	m_Queue.push_back(Task);
+	m_Condition.signal();
+	return true;
+}
+
+int CDB_Thread_Pool::Pending_Count(void)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+	return (int)m_Queue.size();
+}
+
+int CDB_Thread_Pool::Thread_Count(void)
+{
+	return (int)m_Workers.size();
+}
+
+bool CDB_Thread_Pool::Next_Task(osg::ref_ptr<CDB_Thread_Task> &Task)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+	while (true)
+	{
+		while (m_Queue.empty() && !m_Done)
+			m_Condition.wait(&m_Mutex);
+
+		if (m_Done)
+			return false;
+
+		Task = m_Queue.front();
+		m_Queue.pop_front();
+		//Skip anything that was cancelled while it was waiting in the queue
+		if (!Task->Is_Cancelled())
+			return true;
+		Task = NULL;
+	}
+}
+
+void CDB_Thread_Pool::Shutdown(void)
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		if (m_Done && m_Workers.empty())
+			return;
+		m_Done = true;
+		for (CDB_Thread_TaskQ::iterator ti = m_Queue.begin(); ti != m_Queue.end(); ++ti)
+			(*ti)->Cancel();
+		m_Queue.clear();
+		m_Condition.broadcast();
+	}
+
+	//Wait for the running tasks to finish before tearing down the workers
+	for (size_t i = 0; i < m_Workers.size(); ++i)
+	{
+		m_Workers[i]->join();
+		delete m_Workers[i];
+	}
+	m_Workers.clear();
+}
@@ -19,9 +19,31 @@
 // Modified for General Incorporation of Common Database (CDB) support within osgEarth
 //
 #include "CDB_Tile"
+#include "CDB_Thread_Pool"
+#include "CDB_DXT"
+#include "CDB_Buffer_Pool"
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Condition>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <cpl_vsi.h>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <fstream>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define CDB_TILE_SSE2
+#include <emmintrin.h>
+#endif
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <process.h>
+#else
+#include <unistd.h>
 #endif
 
 #define GEOTRSFRM_TOPLEFT_X            0
@@ -33,18 +55,443 @@
 
 #define JP2DRIVERCNT 5
 
+//The JPEG 2000 drivers in the order they are tried when none has been calibrated
+static const char * s_JP2DriverNames[JP2DRIVERCNT] =
+{
+	"JP2ECW",		//ERDAS supplied JP2 Plugin
+	"JP2OpenJPEG",	//LibOpenJPEG2000
+	"JPEG2000",		//JASPER
+	"JP2KAK",		//Kakadu Library
+	"JP2MrSID"		//MR SID SDK
+};
+static OpenThreads::Mutex s_JP2_Calibration_Mutex;
+
+//Source tiles needing less than this part of their pixels are decoded in part
+//rather than whole through the decoded tile cache
+#define CDB_MAX_WINDOW_FRACTION 0.3
+
+//Elevations outside of this range are treated as missing
+#define CDB_MIN_VALID_ELEVATION -32000.0f
+#define CDB_MAX_VALID_ELEVATION 32000.0f
+
 CDB_GDAL_Drivers Gbl_TileDrivers;
 
 static int s_BaseMapLodNum = 0;
 
+static OpenThreads::Mutex s_Cancel_Stats_Mutex;
+static CDB_Cancel_Stats s_Cancel_Stats;
+
+static OpenThreads::Mutex s_Temp_Name_Mutex;
+static unsigned int s_Temp_Name_Count = 0;
+
+static inline bool Valid_Elevation(float h, float nodata)
+{
+	return (h >= CDB_MIN_VALID_ELEVATION) && (h <= CDB_MAX_VALID_ELEVATION) && (h != nodata);
+}
+
+#ifdef CDB_TILE_SSE2
+//All ones in the lanes holding a valid elevation. Ordered compares are false for NaN.
+static inline __m128 Valid_Elevation_Mask(__m128 h, __m128 nodata)
+{
+	__m128 valid = _mm_and_ps(_mm_cmpge_ps(h, _mm_set1_ps(CDB_MIN_VALID_ELEVATION)), _mm_cmple_ps(h, _mm_set1_ps(CDB_MAX_VALID_ELEVATION)));
+	return _mm_and_ps(valid, _mm_cmpneq_ps(h, nodata));
+}
+#endif
+
+//Keeps the valid subordinate heights in Sub and fills the rest from the primary,
+//heights valid in neither become NO_DATA_VALUE
+static void Overlay_Elevation(float *Sub, float SubNoData, const float *Primary, float PrimaryNoData, size_t Count)
+{
+	size_t i = 0;
+#ifdef CDB_TILE_SSE2
+	const __m128 v_subnodata = _mm_set1_ps(SubNoData);
+	const __m128 v_primnodata = _mm_set1_ps(PrimaryNoData);
+	const __m128 v_marker = _mm_set1_ps(NO_DATA_VALUE);
+	for (; i + 4 <= Count; i += 4)
+	{
+		__m128 s = _mm_loadu_ps(Sub + i);
+		__m128 p = _mm_loadu_ps(Primary + i);
+		__m128 s_valid = Valid_Elevation_Mask(s, v_subnodata);
+		__m128 p_valid = Valid_Elevation_Mask(p, v_primnodata);
+		__m128 under = _mm_or_ps(_mm_and_ps(p_valid, p), _mm_andnot_ps(p_valid, v_marker));
+		_mm_storeu_ps(Sub + i, _mm_or_ps(_mm_and_ps(s_valid, s), _mm_andnot_ps(s_valid, under)));
+	}
+#endif
+	for (; i < Count; ++i)
+	{
+		if (!Valid_Elevation(Sub[i], SubNoData))
+			Sub[i] = Valid_Elevation(Primary[i], PrimaryNoData) ? Primary[i] : NO_DATA_VALUE;
+	}
+}
+
+//Where one destination column (or row) samples a source tile. The two source
+//pixels and their weights match the bilinear sampling of Get_Image_Pixel and
+//Get_Elevation_Pixel. Rows hold buffer offsets, columns pixel offsets.
+struct CDB_Sample_Index
+{
+	bool	Valid;
+	int		Pos0;
+	int		Pos1;
+	float	Weight0;
+	float	Weight1;
+	CDB_Sample_Index() : Valid(false), Pos0(0), Pos1(0), Weight0(1.0f), Weight1(0.0f)
+	{
+	}
+
+	void Set(double Pix, int Size, int Stride)
+	{
+		int t = (int)Pix;
+		Valid = (t >= 0) && (t <= Size - 1);
+		if (!Valid)
+			return;
+		double frac = Pix - double(t);
+		//Positions that are on a source pixel apart from the error accumulated
+		//stepping across the tile are taken as on it
+		if (frac > 1.0 - 1e-6)
+		{
+			if (t < Size - 1)
+				++t;
+			frac = 0.0;
+		}
+		else if (frac < 1e-6)
+			frac = 0.0;
+		Pos0 = t * Stride;
+		Pos1 = (t == Size - 1) ? Pos0 : Pos0 + Stride;
+		Weight1 = (float)frac;
+		Weight0 = 1.0f - Weight1;
+	}
+};
+typedef std::vector<CDB_Sample_Index> CDB_Sample_IndexV;
+
+static OpenThreads::Mutex s_Composite_Mutex;
+static int s_Composite_Threads = 4;
+static osg::ref_ptr<CDB_Thread_Pool> s_Composite_Pool;
+
+static osg::ref_ptr<CDB_Thread_Pool> Composite_Pool(void)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Composite_Mutex);
+	if (s_Composite_Threads < 1)
+		return NULL;
+	if (!s_Composite_Pool.valid())
+		s_Composite_Pool = new CDB_Thread_Pool(s_Composite_Threads);
+	return s_Composite_Pool.get();
+}
+
+//The sub-tiles of one composite tile, handed out one at a time to the
+//requesting thread and to the helper tasks it put on the composite pool.
+//The sub-tiles write to disjoint parts of the destination buffers. Helpers the
+//pool starts after the build has finished only look at the count, the tile list
+//belongs to the requesting thread and is gone by then.
+class CDB_Composite_Build : public osg::Referenced
+{
+public:
+	CDB_Composite_Build(CDB_Tile *Dest, CDB_TilePV *Tiles, osgEarth::ProgressCallback *Progress) : m_Dest(Dest), m_Tiles(Tiles), m_Count(Tiles->size()), m_Progress(Progress),
+		m_Next(0), m_Finished(0), m_Have_Contribution(false), m_Cancelled(false), m_Skipped(0), m_Decode_Secs(0.0)
+	{
+	}
+
+	void Work(void)
+	{
+		size_t index;
+		while (Next(index))
+		{
+			CDB_TileP tile = m_Tiles->at(index);
+			bool loaded = false;
+			bool skipped = false;
+			double decode_secs = 0.0;
+			if (CDB_Tile::Is_Cancelled(m_Progress))
+			{
+				Image_Contrib SkipContrib = tile->Get_Contribution(m_Dest->m_TileExtent);
+				skipped = (SkipContrib == Full) || (SkipContrib == Partial);
+			}
+			else
+				loaded = m_Dest->Composite_Sub_Tile(tile, m_Progress, decode_secs);
+
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+			if (loaded)
+				m_Have_Contribution = true;
+			if (skipped)
+			{
+				m_Cancelled = true;
+				++m_Skipped;
+			}
+			m_Decode_Secs += decode_secs;
+			if (++m_Finished == m_Count)
+				m_Done.broadcast();
+		}
+	}
+
+	void Wait(void)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		while (m_Finished < m_Count)
+			m_Done.wait(&m_Mutex);
+	}
+
+	bool Have_Contribution(void)
+	{
+		return m_Have_Contribution;
+	}
+
+	bool Cancelled(void)
+	{
+		return m_Cancelled;
+	}
+
+	int Skipped(void)
+	{
+		return m_Skipped;
+	}
+
+	double Decode_Secs(void)
+	{
+		return m_Decode_Secs;
+	}
+
+private:
+	bool Next(size_t &Index)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		if (m_Next >= m_Count)
+			return false;
+		Index = m_Next++;
+		return true;
+	}
+
+	CDB_Tile *						m_Dest;
+	CDB_TilePV *					m_Tiles;
+	size_t							m_Count;
+	osgEarth::ProgressCallback *	m_Progress;
+	OpenThreads::Mutex				m_Mutex;
+	OpenThreads::Condition			m_Done;
+	size_t							m_Next;
+	size_t							m_Finished;
+	bool							m_Have_Contribution;
+	bool							m_Cancelled;
+	int								m_Skipped;
+	double							m_Decode_Secs;
+};
+
+class CDB_Composite_Task : public CDB_Thread_Task
+{
+public:
+	CDB_Composite_Task(CDB_Composite_Build *Build) : m_Build(Build)
+	{
+	}
+
+	virtual void Run(void)
+	{
+		m_Build->Work();
+	}
+
+private:
+	osg::ref_ptr<CDB_Composite_Build>	m_Build;
+};
+
+//Reads the primary elevation under a subordinate component. Whichever of a pool
+//worker or the requesting thread gets to it first does the read.
+class CDB_Primary_Read : public CDB_Thread_Task
+{
+public:
+	CDB_Primary_Read(const std::string &Name, int PixX, int PixY, int Lod, osgEarth::ProgressCallback *Progress) : Data(NULL), NoData(NO_DATA_VALUE),
+		Loaded(false), m_Name(Name), m_PixX(PixX), m_PixY(PixY), m_Lod(Lod), m_Progress(Progress), m_Claimed(false), m_Done(false)
+	{
+		for (int i = 0; i < 6; ++i)
+			GeoTransform[i] = 0.0;
+	}
+
+	virtual void Run(void)
+	{
+		if (Claim())
+			Read_Primary();
+	}
+
+	//Reads the primary here unless a worker already has it, then waits for it.
+	//Once this returns the task no longer uses the progress callback.
+	void Finish(bool Read = true)
+	{
+		if (Claim())
+		{
+			if (Read)
+				Read_Primary();
+			return;
+		}
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		while (!m_Done)
+			m_Finished.wait(&m_Mutex);
+	}
+
+	float *		Data;
+	float		NoData;
+	double		GeoTransform[6];
+	bool		Loaded;
+
+protected:
+	virtual ~CDB_Primary_Read()
+	{
+		CDB_Buffer_Pool::Release(Data);
+	}
+
+private:
+	bool Claim(void)
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		if (m_Claimed)
+			return false;
+		m_Claimed = true;
+		return true;
+	}
+
+	void Read_Primary(void)
+	{
+		if (!CDB_Tile::Is_Cancelled(m_Progress))
+		{
+			CDB_Stats_Timer decode_timer(CDB_Stat_Decode, m_Lod);
+			GDALOpenInfo oOpenInfo(m_Name.c_str(), GA_ReadOnly);
+			GDALDataset *poDataset = (GDALDataset *)Gbl_TileDrivers.cdb_GTIFFDriver->pfnOpen(&oOpenInfo);
+			if (poDataset)
+			{
+				int srcX = poDataset->GetRasterXSize();
+				int srcY = poDataset->GetRasterYSize();
+				poDataset->GetGeoTransform(GeoTransform);
+				//GDAL resamples a primary stored at another size to the subordinate's
+				GeoTransform[GEOTRSFRM_WE_RES] *= (double)srcX / (double)m_PixX;
+				GeoTransform[GEOTRSFRM_NS_RES] *= (double)srcY / (double)m_PixY;
+				GDALRasterBand *ElevationBand = poDataset->GetRasterBand(1);
+				Data = (float *)CDB_Buffer_Pool::Allocate((size_t)m_PixX * (size_t)m_PixY * sizeof(float));
+				if (ElevationBand->RasterIO(GF_Read, 0, 0, srcX, srcY, Data, m_PixX, m_PixY, GDT_Float32, 0, 0) != CE_Failure)
+				{
+					int hasnodata = 0;
+					double nodata = ElevationBand->GetNoDataValue(&hasnodata);
+					NoData = hasnodata ? (float)nodata : NO_DATA_VALUE;
+					Loaded = true;
+				}
+				GDALClose(poDataset);
+			}
+		}
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(m_Mutex);
+		m_Done = true;
+		m_Finished.broadcast();
+	}
+
+	std::string						m_Name;
+	int								m_PixX;
+	int								m_PixY;
+	int								m_Lod;
+	osgEarth::ProgressCallback *	m_Progress;
+	OpenThreads::Mutex				m_Mutex;
+	OpenThreads::Condition			m_Finished;
+	bool							m_Claimed;
+	bool							m_Done;
+};
+
+//The decoded pixels of a CDB tile shared by the CDB_Tiles that sample it
+class CDB_Decoded_Tile : public osg::Referenced
+{
+public:
+	CDB_Decoded_Tile() : Image_Data(NULL), Elevation_Data(NULL), Elevation_NoData(NO_DATA_VALUE), Bytes(0), Ready(false), Failed(false)
+	{
+		for (int i = 0; i < 6; ++i)
+			GeoTransform[i] = 0.0;
+	}
+
+	unsigned char *	Image_Data;
+	float *			Elevation_Data;
+	float			Elevation_NoData;
+	size_t			Bytes;
+	double			GeoTransform[6];
+	bool			Ready;
+	bool			Failed;
+
+protected:
+	virtual ~CDB_Decoded_Tile()
+	{
+		CDB_Buffer_Pool::Release(Image_Data);
+		CDB_Buffer_Pool::Release(Elevation_Data);
+	}
+};
+typedef std::map<std::string, osg::ref_ptr<CDB_Decoded_Tile> > CDB_Decoded_TileMap;
+
+static OpenThreads::Mutex s_Decoded_Mutex;
+static OpenThreads::Condition s_Decoded_Done;
+static CDB_Decoded_TileMap s_Decoded_Tiles;
+static std::list<std::string> s_Decoded_Order;
+static size_t s_Decoded_Budget = 64 * 1024 * 1024;
+static size_t s_Decoded_Bytes = 0;
+
+//Drops the least recently used decoded tiles until the cache is within its budget.
+//Tiles still in use stay alive until the last CDB_Tile sampling them lets go.
+static void Trim_Decoded_Tiles(void)
+{
+	std::list<std::string>::iterator oi = s_Decoded_Order.end();
+	while ((s_Decoded_Bytes > s_Decoded_Budget) && (oi != s_Decoded_Order.begin()))
+	{
+		--oi;
+		CDB_Decoded_TileMap::iterator di = s_Decoded_Tiles.find(*oi);
+		if ((di != s_Decoded_Tiles.end()) && !di->second->Ready)
+			continue;
+		if (di != s_Decoded_Tiles.end())
+		{
+			s_Decoded_Bytes -= di->second->Bytes;
+			s_Decoded_Tiles.erase(di);
+		}
+		oi = s_Decoded_Order.erase(oi);
+	}
+}
+
+//A name next to the final file, unique to this process, to write a cache tile to
+//before it is renamed into place
+static std::string Temp_Cache_Name(const std::string &FileName)
+{
+	unsigned int count;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Temp_Name_Mutex);
+		count = ++s_Temp_Name_Count;
+	}
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = (int)getpid();
+#endif
+	std::stringstream buf;
+	size_t extpos = FileName.rfind('.');
+	size_t seppos = FileName.find_last_of("/\\");
+	if ((extpos != std::string::npos) && ((seppos == std::string::npos) || (extpos > seppos)))
+		buf << FileName.substr(0, extpos) << "_tmp" << pid << "_" << count << FileName.substr(extpos);
+	else
+		buf << FileName << "_tmp" << pid << "_" << count;
+	return buf.str();
+}
+
+//Replaces the destination if it exists so readers only ever see a complete file
+static bool Rename_Cache_File(const std::string &From, const std::string &To)
+{
+#ifdef _WIN32
+	return ::MoveFileExA(From.c_str(), To.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return ::rename(From.c_str(), To.c_str()) == 0;
+#endif
+}
+
+#if GDAL_VERSION_MAJOR >= 2
+//Lets GDAL abandon a decode part way through once the request has been cancelled
+static int CPL_STDCALL CDB_GDAL_Progress(double dfComplete, const char *pszMessage, void *pProgressArg)
+{
+	osgEarth::ProgressCallback *progress = (osgEarth::ProgressCallback *)pProgressArg;
+	return progress->isCanceled() ? FALSE : TRUE;
+}
+#endif
+
 const int Gbl_CDB_Tile_Sizes[11] = {1024, 512, 256, 128, 64, 32, 16, 8, 4, 2, 1};
 //Caution this only goes down to CDB Level 17
 const double Gbl_CDB_Tiles_Per_LOD[18] = {1.0, 2.0, 4.0, 8.0, 16.0, 32.0, 64.0, 128.0, 256.0, 512.0, 1024.0, 2048.0, 4096.0, 8192.0, 16384.0, 32768.0, 65536.0, 131072.0};
 
 CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Type TileType, std::string dataset, CDB_Tile_Extent *TileExtent, int NLod) : m_cdbRootDir(cdbRootDir), m_cdbCacheDir(cdbCacheDir),
 				   m_DataSet(dataset), m_TileExtent(*TileExtent), m_TileType(TileType), m_ImageContent_Status(NotSet), m_Tile_Status(Created), m_FileName(""), m_LayerName(""), m_FileExists(false),
-				   m_CDB_LOD_Num(0), m_Subordinate_Component(false), m_PrimaryName(""), m_lat_str(""), m_lon_str(""), m_lod_str(""), m_uref_str(""), m_rref_str("")
+				   m_CDB_LOD_Num(0), m_Subordinate_Component(false), m_SubordinateExists(false), m_PrimaryExists(false), m_Output_Scale(1), m_PrimaryName(""), m_lat_str(""), m_lon_str(""), m_lod_str(""), m_uref_str(""), m_rref_str(""),
+				   m_CacheStore(NULL), m_CacheKey("")
 {
+	CDB_Stats_Timer probe_timer(CDB_Stat_Path_Probe, 0);
 	m_GTModelSet.clear();
 
 	if (NLod > 0)
@@ -58,6 +505,7 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 	std::stringstream	primarybuf;
 
 	m_CDB_LOD_Num = GetPathComponents(m_lat_str, m_lon_str, m_lod_str, m_uref_str, m_rref_str);
+	probe_timer.Set_Lod(m_CDB_LOD_Num);
 
 	std::string filetype;
 	std::string datasetstr;
@@ -134,41 +582,45 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 	{
 		if (NLod == 0)
 		{
+			if ((m_TileType == ImageryCache) || (m_TileType == ElevationCache))
+			{
+				m_CacheStore = CDB_Cache_Store::Find(cdbCacheDir, m_LayerName, datasetstr);
+				m_CacheKey = m_lat_str + m_lon_str + "_" + m_lod_str + "_" + m_uref_str + "_" + m_rref_str;
+			}
 			buf << cdbCacheDir
-				<< "\\" << m_LayerName
-				<< "\\" << m_lat_str << m_lon_str << datasetstr << m_lod_str
+				<< "/" << m_LayerName
+				<< "/" << m_lat_str << m_lon_str << datasetstr << m_lod_str
 				<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 
 			if (m_Subordinate_Component)
 			{
-				primarybuf << cdbRootDir
-					<< cdbCacheDir
-					<< "\\" << m_LayerName
-					<< "\\" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
+				primarybuf << cdbCacheDir
+					<< "/" << m_LayerName
+					<< "/" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
 					<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 			}
 		}
 		else
 		{
 			buf << cdbRootDir
-				<< "\\Tiles"
-				<< "\\" << m_lat_str
-				<< "\\" << m_lon_str
-				<< "\\" << m_LayerName
-				<< "\\LC"
-				<< "\\" << m_uref_str
-				<< "\\" << m_lat_str << m_lon_str << datasetstr << m_lod_str
+				<< "/Tiles"
+				<< "/" << m_lat_str
+				<< "/" << m_lon_str
+				<< "/" << m_LayerName
+				<< "/LC"
+				<< "/" << m_uref_str
+				<< "/" << m_lat_str << m_lon_str << datasetstr << m_lod_str
 				<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 			if (m_Subordinate_Component)
 			{
 				primarybuf << cdbRootDir
-					<< "\\Tiles"
-					<< "\\" << m_lat_str
-					<< "\\" << m_lon_str
-					<< "\\" << m_LayerName
-					<< "\\LC"
-					<< "\\" << m_uref_str
-					<< "\\" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
+					<< "/Tiles"
+					<< "/" << m_lat_str
+					<< "/" << m_lon_str
+					<< "/" << m_LayerName
+					<< "/LC"
+					<< "/" << m_uref_str
+					<< "/" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
 					<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 
 			}
@@ -177,25 +629,25 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 	else
 	{
 		buf << cdbRootDir
-			<< "\\Tiles"
-			<< "\\" << m_lat_str
-			<< "\\" << m_lon_str
-			<< "\\" << m_LayerName
-			<< "\\" << m_lod_str
-			<< "\\" << m_uref_str
-			<< "\\" << m_lat_str << m_lon_str << datasetstr << m_lod_str
+			<< "/Tiles"
+			<< "/" << m_lat_str
+			<< "/" << m_lon_str
+			<< "/" << m_LayerName
+			<< "/" << m_lod_str
+			<< "/" << m_uref_str
+			<< "/" << m_lat_str << m_lon_str << datasetstr << m_lod_str
 			<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 
 		if (m_Subordinate_Component)
 		{
 			primarybuf << cdbRootDir
-				<< "\\Tiles"
-				<< "\\" << m_lat_str
-				<< "\\" << m_lon_str
-				<< "\\" << m_LayerName
-				<< "\\" << m_lod_str
-				<< "\\" << m_uref_str
-				<< "\\" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
+				<< "/Tiles"
+				<< "/" << m_lat_str
+				<< "/" << m_lon_str
+				<< "/" << m_LayerName
+				<< "/" << m_lod_str
+				<< "/" << m_uref_str
+				<< "/" << m_lat_str << m_lon_str << primarydatasetstr << m_lod_str
 				<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 		}
 	}
@@ -208,13 +660,13 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 		std::stringstream dbfbuf;
 
 		dbfbuf << cdbRootDir
-			<< "\\Tiles"
-			<< "\\" << m_lat_str
-			<< "\\" << m_lon_str
-			<< "\\" << m_LayerName
-			<< "\\" << m_lod_str
-			<< "\\" << m_uref_str
-			<< "\\" << m_lat_str << m_lon_str << dataset2str << m_lod_str
+			<< "/Tiles"
+			<< "/" << m_lat_str
+			<< "/" << m_lon_str
+			<< "/" << m_LayerName
+			<< "/" << m_lod_str
+			<< "/" << m_uref_str
+			<< "/" << m_lat_str << m_lon_str << dataset2str << m_lod_str
 			<< "_" << m_uref_str << "_" << m_rref_str << filetype2str;
 
 		m_ModelSet.ModelDbfName = dbfbuf.str();
@@ -224,13 +676,13 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 		std::string layerName2 = "300_GSModelGeometry";
 		std::stringstream geombuf;
 		geombuf << cdbRootDir
-			<< "\\Tiles"
-			<< "\\" << m_lat_str
-			<< "\\" << m_lon_str
-			<< "\\" << layerName2
-			<< "\\" << m_lod_str
-			<< "\\" << m_uref_str
-			<< "\\" << m_lat_str << m_lon_str << dataset2str << m_lod_str
+			<< "/Tiles"
+			<< "/" << m_lat_str
+			<< "/" << m_lon_str
+			<< "/" << layerName2
+			<< "/" << m_lod_str
+			<< "/" << m_uref_str
+			<< "/" << m_lat_str << m_lon_str << dataset2str << m_lod_str
 			<< "_" << m_uref_str << "_" << m_rref_str << filetype2str;
 
 		m_ModelSet.ModelGeometryName = geombuf.str();
@@ -240,13 +692,13 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 		layerName2 = "301_GSModelTexture";
 		std::stringstream txbuf;
 		txbuf << cdbRootDir
-			<< "\\Tiles"
-			<< "\\" << m_lat_str
-			<< "\\" << m_lon_str
-			<< "\\" << layerName2
-			<< "\\" << m_lod_str
-			<< "\\" << m_uref_str
-			<< "\\" << m_lat_str << m_lon_str << dataset2str << m_lod_str
+			<< "/Tiles"
+			<< "/" << m_lat_str
+			<< "/" << m_lon_str
+			<< "/" << layerName2
+			<< "/" << m_lod_str
+			<< "/" << m_uref_str
+			<< "/" << m_lat_str << m_lon_str << dataset2str << m_lod_str
 			<< "_" << m_uref_str << "_" << m_rref_str << filetype2str;
 
 		m_ModelSet.ModelTextureName = txbuf.str();
@@ -283,13 +735,13 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 
 			std::stringstream f1buf;
 			f1buf << cdbRootDir
-				<< "\\Tiles"
-				<< "\\" << m_lat_str
-				<< "\\" << m_lon_str
-				<< "\\" << m_LayerName
-				<< "\\" << m_lod_str
-				<< "\\" << m_uref_str
-				<< "\\" << m_lat_str << m_lon_str << datasetstr << m_lod_str
+				<< "/Tiles"
+				<< "/" << m_lat_str
+				<< "/" << m_lon_str
+				<< "/" << m_LayerName
+				<< "/" << m_lod_str
+				<< "/" << m_uref_str
+				<< "/" << m_lat_str << m_lon_str << datasetstr << m_lod_str
 				<< "_" << m_uref_str << "_" << m_rref_str << filetype;
 			t.TilePrimaryShapeName = f1buf.str();
 
@@ -306,13 +758,13 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 
 			std::stringstream f2buf;
 			f2buf << cdbRootDir
-				<< "\\Tiles"
-				<< "\\" << m_lat_str
-				<< "\\" << m_lon_str
-				<< "\\" << m_LayerName
-				<< "\\" << m_lod_str
-				<< "\\" << m_uref_str
-				<< "\\" << m_lat_str << m_lon_str << datasetstr << m_lod_str
+				<< "/Tiles"
+				<< "/" << m_lat_str
+				<< "/" << m_lon_str
+				<< "/" << m_LayerName
+				<< "/" << m_lod_str
+				<< "/" << m_uref_str
+				<< "/" << m_lat_str << m_lon_str << datasetstr << m_lod_str
 				<< "_" << m_uref_str << "_" << m_rref_str << filetype2str;
 			t.TileSecondaryShapeName = f2buf.str();
 
@@ -350,11 +802,24 @@ CDB_Tile::CDB_Tile(std::string cdbRootDir, std::string cdbCacheDir, CDB_Tile_Typ
 		m_ModelSet.ModelTextureNameExists = validate_tile_name(m_ModelSet.ModelTextureName);
 
 	}
+	else if (m_CacheStore)
+	{
+		m_FileExists = m_CacheStore->Contains(m_CacheKey);
+	}
 	else
 	{
 		m_FileExists = validate_tile_name(m_FileName);
 	}
 
+	if (m_Subordinate_Component && (m_TileType == Elevation))
+	{
+		//The subordinate component only covers part of the tile (i.e. bathymetry)
+		//and is overlaid on the primary so the tile exists if either one does
+		m_SubordinateExists = m_FileExists;
+		m_PrimaryExists = validate_tile_name(m_PrimaryName);
+		m_FileExists = m_SubordinateExists || m_PrimaryExists;
+	}
+
 	if (((m_TileType == GeoPackageMap)) && (!m_FileExists))
 	{
 		size_t spos = m_FileName.find_last_of(".gpkg");
@@ -401,6 +866,29 @@ int CDB_Tile::CDB_LOD_Num(void)
 	return m_CDB_LOD_Num;
 }
 
+void CDB_Tile::Set_Cache_Format(const CDB_Cache_Format &Format)
+{
+	m_CacheFormat = Format;
+	//Packed stores keep their own layout whatever the file format
+	if ((m_TileType != ElevationCache) || m_CacheStore)
+		return;
+
+	//Elevation cache tiles can be written as GeoTIFF to get access to its compression options
+	std::string filetype = m_CacheFormat.Elevation_GTiff ? ".tif" : ".img";
+	size_t extpos = m_FileName.rfind('.');
+	if ((extpos != std::string::npos) && (m_FileName.substr(extpos) != filetype))
+	{
+		//Tiles built before the format was changed are still read from their own file
+		std::string formatName = m_FileName.substr(0, extpos) + filetype;
+		bool formatExists = validate_tile_name(formatName);
+		if (formatExists || !m_FileExists)
+		{
+			m_FileName = formatName;
+			m_FileExists = formatExists;
+		}
+	}
+}
+
 void CDB_Tile::Free_Resources(void)
 {
 	Close_Dataset();
@@ -552,12 +1040,12 @@ int CDB_Tile::GetPathComponents(std::string& lat_str, std::string& lon_str, std:
 
 void CDB_Tile::Allocate_Buffers(void)
 {
-	int bandbuffersize = m_Pixels.pixX * m_Pixels.pixY;
+	size_t bandbuffersize = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
 	if ((m_TileType == Imagery) || (m_TileType == ImageryCache))
 	{
 		if (!m_GDAL.reddata)
 		{
-			m_GDAL.reddata = new unsigned char[bandbuffersize * 3];
+			m_GDAL.reddata = (unsigned char *)CDB_Buffer_Pool::Allocate(bandbuffersize * 3);
 			m_GDAL.greendata = m_GDAL.reddata + bandbuffersize;
 			m_GDAL.bluedata = m_GDAL.greendata + bandbuffersize;
 		}
@@ -565,22 +1053,31 @@ void CDB_Tile::Allocate_Buffers(void)
 	else if ((m_TileType == Elevation) || (m_TileType == ElevationCache))
 	{
 		if (!m_GDAL.elevationdata)
-			m_GDAL.elevationdata = new float[bandbuffersize];
+			m_GDAL.elevationdata = (float *)CDB_Buffer_Pool::Allocate(bandbuffersize * sizeof(float));
 	}
 }
 
 void CDB_Tile::Free_Buffers(void)
 {
+	if (m_Decoded.valid())
+	{
+		//The buffers belong to the decoded tile cache
+		m_GDAL.reddata = NULL;
+		m_GDAL.greendata = NULL;
+		m_GDAL.bluedata = NULL;
+		m_GDAL.elevationdata = NULL;
+		m_Decoded = NULL;
+	}
 	if (m_GDAL.reddata)
 	{
-		delete m_GDAL.reddata;
+		CDB_Buffer_Pool::Release(m_GDAL.reddata);
 		m_GDAL.reddata = NULL;
 		m_GDAL.greendata = NULL;
 		m_GDAL.bluedata = NULL;
 	}
 	if (m_GDAL.elevationdata)
 	{
-		delete m_GDAL.elevationdata;
+		CDB_Buffer_Pool::Release(m_GDAL.elevationdata);
 		m_GDAL.elevationdata = NULL;
 	}
 	if (m_Tile_Status == Loaded)
@@ -614,6 +1111,7 @@ bool CDB_Tile::Open_Tile(void)
 	if (m_GDAL.poDataset)
 		return true;
 
+	CDB_Stats_Timer open_timer(CDB_Stat_GDAL_Open, m_CDB_LOD_Num);
 	GDALOpenInfo oOpenInfo(m_FileName.c_str(), GA_ReadOnly);
 	if (m_TileType == Imagery)
 	{
@@ -629,7 +1127,10 @@ bool CDB_Tile::Open_Tile(void)
 	}
 	else if (m_TileType == ElevationCache)
 	{
-		m_GDAL.poDriver = Gbl_TileDrivers.cdb_HFADriver;
+		if (m_FileName.substr(m_FileName.rfind('.')) == ".tif")
+			m_GDAL.poDriver = Gbl_TileDrivers.cdb_GTIFFDriver;
+		else
+			m_GDAL.poDriver = Gbl_TileDrivers.cdb_HFADriver;
 	}
 	else if (m_TileType == GeoTypicalModel)
 	{
@@ -653,10 +1154,33 @@ bool CDB_Tile::Open_Tile(void)
 		return false;
 	}
 	m_GDAL.poDataset->GetGeoTransform(m_GDAL.adfGeoTransform);
+	if (m_Output_Scale > 1)
+	{
+		//The buffers hold the raster decimated to the output size
+		m_GDAL.adfGeoTransform[GEOTRSFRM_WE_RES] *= (double)m_Output_Scale;
+		m_GDAL.adfGeoTransform[GEOTRSFRM_NS_RES] *= (double)m_Output_Scale;
+	}
 	m_Tile_Status = Opened;
 	return true;
 }
 
+void CDB_Tile::Set_Output_Size(int Size)
+{
+	if ((Size <= 0) || (Size >= m_Pixels.pixX) || (m_Tile_Status != Created) || m_CacheStore)
+		return;
+	if ((m_TileType != Imagery) && (m_TileType != Elevation) && (m_TileType != ImageryCache) && (m_TileType != ElevationCache))
+		return;
+	if ((m_Pixels.pixX % Size) || (m_Pixels.pixY % Size))
+		return;
+
+	int scale = m_Pixels.pixX / Size;
+	m_Output_Scale *= scale;
+	m_Pixels.pixX /= scale;
+	m_Pixels.pixY /= scale;
+	m_Pixels.degPerPix.Xpos = (m_TileExtent.East - m_TileExtent.West) / (double)(m_Pixels.pixX);
+	m_Pixels.degPerPix.Ypos = (m_TileExtent.North - m_TileExtent.South) / (double)(m_Pixels.pixY);
+}
+
 bool CDB_Tile::Open_GS_Model_Tile(void)
 {
 	if (m_FileExists && m_ModelSet.ModelDbfNameExists && m_ModelSet.ModelGeometryNameExists)
@@ -673,7 +1197,7 @@ bool CDB_Tile::Open_GS_Model_Tile(void)
 			std::string shx = Set_FileType(m_ModelSet.ModelDbfName, ".shx");
 			if (validate_tile_name(shx))
 			{
-				if (::DeleteFile(shx.c_str()) == 0)
+				if (VSIUnlink(shx.c_str()) != 0)
 				{
 					return false;
 				}
@@ -681,7 +1205,7 @@ bool CDB_Tile::Open_GS_Model_Tile(void)
 			std::string shp = Set_FileType(m_ModelSet.ModelDbfName, ".shp");
 			if (validate_tile_name(shp))
 			{
-				if (::DeleteFile(shp.c_str()) == 0)
+				if (VSIUnlink(shp.c_str()) != 0)
 				{
 					return false;
 				}
@@ -717,7 +1241,7 @@ bool CDB_Tile::Open_GT_Model_Tile(void)
 				std::string shx = Set_FileType(m_GTModelSet[i].TileSecondaryShapeName, ".shx");
 				if (validate_tile_name(shx))
 				{
-					if (::DeleteFile(shx.c_str()) == 0)
+					if (VSIUnlink(shx.c_str()) != 0)
 					{
 						continue;
 					}
@@ -725,7 +1249,7 @@ bool CDB_Tile::Open_GT_Model_Tile(void)
 				std::string shp = Set_FileType(m_GTModelSet[i].TileSecondaryShapeName, ".shp");
 				if (validate_tile_name(shp))
 				{
-					if (::DeleteFile(shp.c_str()) == 0)
+					if (VSIUnlink(shp.c_str()) != 0)
 					{
 						continue;
 					}
@@ -749,7 +1273,7 @@ bool CDB_Tile::Open_GP_Map_Tile(void)
 	{
 //		GDALOpenInfo oOpenInfoP(m_FileName.c_str(), GA_ReadOnly | GDAL_OF_VECTOR);
 //		m_GDAL.poDataset = m_GDAL.poDriver->pfnOpen(&oOpenInfoP);
-		char * drivers[2];
+		const char * drivers[2];
 		drivers[0] = "GPKG";
 		drivers[1] = NULL;
 		m_GDAL.poDataset = (GDALDataset *)GDALOpenEx(m_FileName.c_str(), GDAL_OF_VECTOR | GA_ReadOnly | GDAL_OF_SHARED, drivers, NULL, NULL);
@@ -994,6 +1518,7 @@ bool CDB_Tile::Init_GS_Model_Tile(void)
 
 bool CDB_Tile::Load_Archive(std::string ArchiveName, osgDB::Archive::FileNameList &archiveFileList)
 {
+	CDB_Stats_Timer list_timer(CDB_Stat_Archive_List, m_CDB_LOD_Num);
 	osg::ref_ptr<osgDB::Archive> ar = NULL;
 	ar = osgDB::openArchive(ArchiveName, osgDB::ReaderWriter::ArchiveStatus::READ);
 	if (ar)
@@ -1097,7 +1622,14 @@ int CDB_Tile::Model_Sel_Count(void)
 		return -1;
 }
 
-bool CDB_Tile::Read(void)
+bool CDB_Tile::Read(osgEarth::ProgressCallback *progress)
+{
+	return Read_Window(0, 0, m_Pixels.pixX, m_Pixels.pixY, progress);
+}
+
+//Reads part of the raster into the same place in the tile buffers
+//the whole raster would go. Only a full read leaves the tile Loaded.
+bool CDB_Tile::Read_Window(int X, int Y, int Width, int Height, osgEarth::ProgressCallback *progress)
 {
 	if (!m_GDAL.poDataset)
 		return false;
@@ -1105,61 +1637,142 @@ bool CDB_Tile::Read(void)
 	if (m_Tile_Status == Loaded)
 		return true;
 
+	if (Is_Cancelled(progress))
+		return false;
 
-	if ((m_TileType == Imagery) || (m_TileType == ImageryCache))
+#if GDAL_VERSION_MAJOR >= 2
+	GDALRasterIOExtraArg sExtraArg;
+	INIT_RASTERIO_EXTRA_ARG(sExtraArg);
+	if (progress)
 	{
-		CPLErr gdal_err = m_GDAL.poDataset->RasterIO(GF_Read, 0, 0, m_Pixels.pixX, m_Pixels.pixY,
-													 m_GDAL.reddata, m_Pixels.pixX, m_Pixels.pixY, GDT_Byte, 3, NULL, 0, 0, 0);
-		if (gdal_err == CE_Failure)
-		{
-			return false;
-		}
+		sExtraArg.pfnProgress = CDB_GDAL_Progress;
+		sExtraArg.pProgressData = progress;
+	}
+#endif
+
+	//The part of the raster under the window, larger than the window when decimating
+	int rasterX = X * m_Output_Scale;
+	int rasterY = Y * m_Output_Scale;
+	int rasterWidth = std::min(Width * m_Output_Scale, m_GDAL.poDataset->GetRasterXSize() - rasterX);
+	int rasterHeight = std::min(Height * m_Output_Scale, m_GDAL.poDataset->GetRasterYSize() - rasterY);
+#if GDAL_VERSION_MAJOR >= 2
+	if (m_Output_Scale > 1)
+		sExtraArg.eResampleAlg = GRIORA_Average;
+#endif
 
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	CPLErr gdal_err = CE_None;
+	size_t offset = (size_t)Y * (size_t)m_Pixels.pixX + (size_t)X;
+	if (Fill_From_Statistics(X, Y, Width, Height))
+	{
+		//Nothing to decode
+	}
+	else if ((m_TileType == Imagery) || (m_TileType == ImageryCache))
+	{
+		int bandspace = m_Pixels.pixX * m_Pixels.pixY;
+#if GDAL_VERSION_MAJOR >= 2
+		gdal_err = m_GDAL.poDataset->RasterIO(GF_Read, rasterX, rasterY, rasterWidth, rasterHeight,
+											  m_GDAL.reddata + offset, Width, Height, GDT_Byte, 3, NULL, 1, m_Pixels.pixX, bandspace, &sExtraArg);
+#else
+		gdal_err = m_GDAL.poDataset->RasterIO(GF_Read, rasterX, rasterY, rasterWidth, rasterHeight,
+											  m_GDAL.reddata + offset, Width, Height, GDT_Byte, 3, NULL, 1, m_Pixels.pixX, bandspace);
+#endif
 	}
 	else if ((m_TileType == Elevation) || (m_TileType == ElevationCache))
 	{
 		GDALRasterBand * ElevationBand = m_GDAL.poDataset->GetRasterBand(1);
 
-		CPLErr gdal_err = ElevationBand->RasterIO(GF_Read, 0, 0, m_Pixels.pixX, m_Pixels.pixY,
-			                                      m_GDAL.elevationdata, m_Pixels.pixX, m_Pixels.pixY, GDT_Float32, 0, 0);
-		if (gdal_err == CE_Failure)
-		{
+#if GDAL_VERSION_MAJOR >= 2
+		gdal_err = ElevationBand->RasterIO(GF_Read, rasterX, rasterY, rasterWidth, rasterHeight,
+										   m_GDAL.elevationdata + offset, Width, Height, GDT_Float32, (int)sizeof(float),
+										   m_Pixels.pixX * (int)sizeof(float), &sExtraArg);
+#else
+		gdal_err = ElevationBand->RasterIO(GF_Read, rasterX, rasterY, rasterWidth, rasterHeight,
+										   m_GDAL.elevationdata + offset, Width, Height, GDT_Float32, (int)sizeof(float),
+										   m_Pixels.pixX * (int)sizeof(float));
+#endif
+		int hasnodata = 0;
+		double nodata = ElevationBand->GetNoDataValue(&hasnodata);
+		m_GDAL.elevationnodata = hasnodata ? (float)nodata : NO_DATA_VALUE;
+	}
+	double decode_secs = osg::Timer::instance()->delta_s(start, osg::Timer::instance()->tick());
+
+	if (gdal_err == CE_Failure)
+	{
+		//A cancelled decode reports failure, the time spent on it is lost. The build it
+		//was part of counts the cancel.
+		if (Is_Cancelled(progress))
+			Record_Wasted(decode_secs);
+		return false;
+	}
+	Record_Decode(decode_secs);
+	CDB_Stats::Record(CDB_Stat_Decode, m_CDB_LOD_Num, decode_secs);
+	if ((X == 0) && (Y == 0) && (Width == m_Pixels.pixX) && (Height == m_Pixels.pixY))
+		m_Tile_Status = Loaded;
+
+	return true;
+}
+
+bool CDB_Tile::Fill_From_Statistics(int X, int Y, int Width, int Height)
+{
+	//Only the cache tiles are stamped by Write, statistics found with source CDB tiles
+	//(i.e. a PAM .aux.xml) may be approximate or stale
+	if ((m_TileType != ImageryCache) && (m_TileType != ElevationCache))
+		return false;
+	bool imagery = (m_TileType == Imagery) || (m_TileType == ImageryCache);
+	int bands = imagery ? 3 : 1;
+	if (m_GDAL.poDataset->GetRasterCount() < bands)
+		return false;
+
+	double values[3];
+	for (int b = 0; b < bands; ++b)
+	{
+		GDALRasterBand * band = m_GDAL.poDataset->GetRasterBand(b + 1);
+		//The statistics leave out the nodata pixels
+		int hasnodata = 0;
+		band->GetNoDataValue(&hasnodata);
+		if (hasnodata)
 			return false;
-		}
+		//Only exact statistics already stored with the tile, never computed here
+		double minval, maxval;
+		if (band->GetStatistics(FALSE, FALSE, &minval, &maxval, NULL, NULL) != CE_None)
+			return false;
+		if (minval != maxval)
+			return false;
+		values[b] = minval;
 	}
-	m_Tile_Status = Loaded;
 
+	for (int r = Y; r < Y + Height; ++r)
+	{
+		size_t row = (size_t)r * (size_t)m_Pixels.pixX + (size_t)X;
+		if (imagery)
+		{
+			memset(m_GDAL.reddata + row, (int)values[0], Width);
+			memset(m_GDAL.greendata + row, (int)values[1], Width);
+			memset(m_GDAL.bluedata + row, (int)values[2], Width);
+		}
+		else
+			std::fill(m_GDAL.elevationdata + row, m_GDAL.elevationdata + row + Width, (float)values[0]);
+	}
+	if (!imagery)
+		m_GDAL.elevationnodata = NO_DATA_VALUE;
 	return true;
 }
 
 void CDB_Tile::Fill_Tile(void)
 {
-	int buffsz = m_Pixels.pixX * m_Pixels.pixY;
+	size_t buffsz = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
 	if (m_TileType == Imagery)
 	{
-		for (int i = 0; i < buffsz; ++i)
-		{
-			m_GDAL.reddata[i] = 127;
-			m_GDAL.greendata[i] = 127;
-			m_GDAL.bluedata[i] = 127;
-		}
+		memset(m_GDAL.reddata, 127, buffsz * 3);
 	}
 	else if ((m_TileType == Elevation) || (m_TileType == ElevationCache))
 	{
-		for (int i = 0; i < buffsz; ++i)
-		{
-			m_GDAL.elevationdata[i] = 0.0f;
-		}
-
+		std::fill(m_GDAL.elevationdata, m_GDAL.elevationdata + buffsz, 0.0f);
 	}
 	else if (m_TileType == ImageryCache)
 	{
-		for (int i = 0; i < buffsz; ++i)
-		{
-			m_GDAL.reddata[i] = 0;
-			m_GDAL.greendata[i] = 0;
-			m_GDAL.bluedata[i] = 0;
-		}
+		memset(m_GDAL.reddata, 0, buffsz * 3);
 	}
 }
 
@@ -1184,7 +1797,7 @@ bool CDB_Tile::Tile_Exists(int sel)
 	return m_FileExists;
 }
 
-bool CDB_Tile::Build_Cache_Tile(bool save_cache)
+bool CDB_Tile::Build_Cache_Tile(bool save_cache, osgEarth::ProgressCallback *progress)
 {
 	//This is not actually part of the CDB specification but
 	//necessary to support an osgEarth global profile
@@ -1212,7 +1825,7 @@ bool CDB_Tile::Build_Cache_Tile(bool save_cache)
 	thisTileExtent.South = MinLat;
 	double lonstep = Get_Lon_Step(thisTileExtent.South);
 	double sign;
-	while (!done)
+	while (!done && !Is_Cancelled(progress))
 	{
 		if (lonstep != 1.0)
 		{
@@ -1250,32 +1863,30 @@ bool CDB_Tile::Build_Cache_Tile(bool save_cache)
 	}
 
 	int tilecnt = (int)Tiles.size();
-	if (tilecnt <= 0)
-		return false;
-
-	Build_From_Tiles(&Tiles);
-
-	if (save_cache && (m_Tile_Status == Loaded))
+	bool built = false;
+	if ((tilecnt > 0) && Build_From_Tiles(&Tiles, false, progress))
 	{
-		Save();
-		m_FileExists = true;
+		built = true;
+		//Never leave a partially written cache tile behind
+		if (save_cache && (m_Tile_Status == Loaded) && Save(progress))
+			m_FileExists = true;
 	}
 
 	//Clean up
-	for each (CDB_TileP Tile in Tiles)
+	for (CDB_TilePV::iterator ti = Tiles.begin(); ti != Tiles.end(); ++ti)
 	{
-		if (Tile)
+		if (*ti)
 		{
-			delete Tile;
-			Tile = NULL;
+			delete *ti;
+			*ti = NULL;
 		}
 	}
 	Tiles.clear();
 
-	return true;
+	return built;
 }
 
-bool CDB_Tile::Build_Earth_Tile(void)
+bool CDB_Tile::Build_Earth_Tile(osgEarth::ProgressCallback *progress)
 {
 	//Build an Earth Profile tile for Latitudes above and below 50 deg
 
@@ -1310,6 +1921,9 @@ bool CDB_Tile::Build_Earth_Tile(void)
 
 	//Now get the actual cdb tile with the correct CDB extents
 	CDB_TileP LodTile = new CDB_Tile(m_cdbRootDir, m_cdbCacheDir, subTileType, m_DataSet, &thisTileExtent);
+	//Read at the same density as this tile
+	if (m_Output_Scale > 1)
+		LodTile->Set_Output_Size(LodTile->m_Pixels.pixX / m_Output_Scale);
 
 	OE_DEBUG "Build_Earth_Tile cdb tile " << LodTile->FileName().c_str() << std::endl;
 
@@ -1328,20 +1942,46 @@ bool CDB_Tile::Build_Earth_Tile(void)
 		return false;
 
 	//Build the osgearth tile from the cdb tile
-	Build_From_Tiles(&Tiles, true);
+	bool built = Build_From_Tiles(&Tiles, true, progress);
 
 	//clean up
-	for each (CDB_TileP Tile in Tiles)
+	for (CDB_TilePV::iterator ti = Tiles.begin(); ti != Tiles.end(); ++ti)
 	{
-		if (Tile)
+		if (*ti)
 		{
-			delete Tile;
-			Tile = NULL;
+			delete *ti;
+			*ti = NULL;
 		}
 	}
 	Tiles.clear();
 
-	return true;
+	return built;
+}
+
+int CDB_Tile::Get_Extent_Lod(const CDB_Tile_Extent &TileExtent)
+{
+	double keylatspace = TileExtent.North - TileExtent.South;
+	int cdbLod = 0;
+	if (keylatspace > 1.0 / 0.99)
+	{
+		int itiles = (int)(round(keylatspace / 2.0));
+		cdbLod = -1;
+		while (itiles > 1)
+		{
+			itiles /= 2;
+			--cdbLod;
+		}
+	}
+	else
+	{
+		int itiles = (int)round(1.0 / keylatspace);
+		while (itiles > 1)
+		{
+			itiles /= 2;
+			++cdbLod;
+		}
+	}
+	return cdbLod;
 }
 
 double CDB_Tile::Get_Lon_Step(double Latitude)
@@ -1388,19 +2028,12 @@ bool CDB_Tile::Initialize_Tile_Drivers(std::string &ErrorMsg)
 	if (Gbl_TileDrivers.cdb_drivers_initialized)
 		return true;
 
-	std::string	cdb_JP2DriverNames[JP2DRIVERCNT];
-	//The JP2 Driver Names should be ordered based on read performance however this has not been done yet.
-	cdb_JP2DriverNames[0] = "JP2ECW";		//ERDAS supplied JP2 Plugin
-	cdb_JP2DriverNames[1] = "JP2OpenJPEG";  //LibOpenJPEG2000
-	cdb_JP2DriverNames[2] = "JPEG2000";	    //JASPER
-	cdb_JP2DriverNames[3] = "JP2KAK";		//Kakadu Library
-	cdb_JP2DriverNames[4] = "JP2MrSID";	    //MR SID SDK
-
 	//Find a jpeg2000 driver for the image layer.
+	//Calibrate_JP2_Drivers picks the fastest of them for a particular CDB.
 	int dcount = 0;
 	while ((Gbl_TileDrivers.cdb_JP2Driver == NULL) && (dcount < JP2DRIVERCNT))
 	{
-		Gbl_TileDrivers.cdb_JP2Driver = GetGDALDriverManager()->GetDriverByName(cdb_JP2DriverNames[dcount].c_str());
+		Gbl_TileDrivers.cdb_JP2Driver = GetGDALDriverManager()->GetDriverByName(s_JP2DriverNames[dcount]);
 		if (Gbl_TileDrivers.cdb_JP2Driver == NULL)
 			++dcount;
 		else if (Gbl_TileDrivers.cdb_JP2Driver->pfnOpen == NULL)
@@ -1470,16 +2103,170 @@ bool CDB_Tile::Initialize_Tile_Drivers(std::string &ErrorMsg)
 	return true;
 }
 
-Image_Contrib CDB_Tile::Get_Contribution(CDB_Tile_Extent &TileExtent)
+static GDALDriver * Available_JP2_Driver(const std::string &Name)
 {
-	//Does the Image fall entirly within the Tile
-	Image_Contrib retval = Image_Is_Inside_Tile(TileExtent);
-	if (retval != None)
-		return retval;
+	GDALDriver *driver = GetGDALDriverManager()->GetDriverByName(Name.c_str());
+	if (driver && (driver->pfnOpen == NULL))
+		driver = NULL;
+	return driver;
+}
 
-	//Check the tile contents against the Image
-	if ((TileExtent.North < m_TileExtent.South) || (TileExtent.South > m_TileExtent.North) ||
-		(TileExtent.East < m_TileExtent.West) || (TileExtent.West > m_TileExtent.East))
+bool CDB_Tile::Set_JP2_Driver(std::string Name)
+{
+	GDALDriver *driver = Available_JP2_Driver(Name);
+	if (!driver)
+		return false;
+	Gbl_TileDrivers.cdb_JP2Driver = driver;
+	return true;
+}
+
+std::string CDB_Tile::Get_JP2_Driver(void)
+{
+	if (!Gbl_TileDrivers.cdb_JP2Driver)
+		return "";
+	return Gbl_TileDrivers.cdb_JP2Driver->GetDescription();
+}
+
+//Best of three whole tile decodes in milliseconds, negative if the driver can not read the file
+static double Time_JP2_Decode(GDALDriver *Driver, const std::string &SampleFile)
+{
+	double best = -1.0;
+	for (int rep = 0; rep < 3; ++rep)
+	{
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		GDALOpenInfo oOpenInfo(SampleFile.c_str(), GA_ReadOnly);
+		GDALDataset *poDataset = (GDALDataset *)Driver->pfnOpen(&oOpenInfo);
+		if (!poDataset)
+			return -1.0;
+		int width = poDataset->GetRasterXSize();
+		int height = poDataset->GetRasterYSize();
+		int bands = std::min(poDataset->GetRasterCount(), 3);
+		std::vector<unsigned char> buffer((size_t)width * (size_t)height * (size_t)bands);
+		CPLErr gdal_err = poDataset->RasterIO(GF_Read, 0, 0, width, height, &buffer[0], width, height, GDT_Byte, bands, NULL, 0, 0, 0);
+		GDALClose(poDataset);
+		if (gdal_err == CE_Failure)
+			return -1.0;
+		double ms = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+		if ((best < 0.0) || (ms < best))
+			best = ms;
+	}
+	return best;
+}
+
+bool CDB_Tile::Calibrate_JP2_Drivers(std::string SampleFile, std::string ResultFile)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_JP2_Calibration_Mutex);
+	std::map<std::string, double> times;
+
+	//Earlier results, one "driver milliseconds" line each
+	if (!ResultFile.empty())
+	{
+		std::ifstream in(ResultFile.c_str());
+		std::string line;
+		while (std::getline(in, line))
+		{
+			if (line.empty() || (line[0] == '#'))
+				continue;
+			std::istringstream fields(line);
+			std::string name;
+			double ms;
+			if ((fields >> name >> ms) && Available_JP2_Driver(name))
+				times[name] = ms;
+		}
+	}
+
+	bool measured = false;
+	if (times.empty())
+	{
+		for (int i = 0; i < JP2DRIVERCNT; ++i)
+		{
+			GDALDriver *driver = Available_JP2_Driver(s_JP2DriverNames[i]);
+			if (!driver)
+				continue;
+			double ms = Time_JP2_Decode(driver, SampleFile);
+			if (ms < 0.0)
+			{
+				OE_INFO "CDB JP2 driver " << s_JP2DriverNames[i] << " can not read " << SampleFile << std::endl;
+				continue;
+			}
+			OE_INFO "CDB JP2 driver " << s_JP2DriverNames[i] << " decodes " << SampleFile << " in " << ms << " ms" << std::endl;
+			times[s_JP2DriverNames[i]] = ms;
+		}
+		measured = true;
+	}
+	if (times.empty())
+		return false;
+
+	std::string fastest;
+	for (std::map<std::string, double>::iterator ti = times.begin(); ti != times.end(); ++ti)
+	{
+		if (fastest.empty() || (ti->second < times[fastest]))
+			fastest = ti->first;
+	}
+
+	if (measured && !ResultFile.empty())
+	{
+		std::ofstream out(ResultFile.c_str());
+		if (out)
+		{
+			out << "# CDB JP2 driver decode milliseconds for " << SampleFile << std::endl;
+			for (std::map<std::string, double>::iterator ti = times.begin(); ti != times.end(); ++ti)
+				out << ti->first << " " << ti->second << std::endl;
+		}
+		else
+			OE_WARN "CDB unable to save the JP2 driver calibration to " << ResultFile << std::endl;
+	}
+
+	OE_NOTICE "CDB using JP2 driver " << fastest << " (" << times[fastest] << " ms per tile" << (measured ? ")" : ", from earlier calibration)") << std::endl;
+	return Set_JP2_Driver(fastest);
+}
+
+std::string CDB_Tile::Find_Sample_JP2(std::string cdbRootDir)
+{
+	std::string tiles = cdbRootDir + "/Tiles";
+	osgDB::DirectoryContents latdirs = osgDB::getDirectoryContents(tiles);
+	for (size_t la = 0; la < latdirs.size(); ++la)
+	{
+		if (latdirs[la][0] == '.')
+			continue;
+		osgDB::DirectoryContents londirs = osgDB::getDirectoryContents(tiles + "/" + latdirs[la]);
+		for (size_t lo = 0; lo < londirs.size(); ++lo)
+		{
+			if (londirs[lo][0] == '.')
+				continue;
+			std::string dir = tiles + "/" + latdirs[la] + "/" + londirs[lo] + "/004_Imagery/L00/U0";
+			osgDB::DirectoryContents files = osgDB::getDirectoryContents(dir);
+			for (size_t f = 0; f < files.size(); ++f)
+			{
+				if (osgDB::getLowerCaseFileExtension(files[f]) == "jp2")
+					return dir + "/" + files[f];
+			}
+		}
+	}
+	return "";
+}
+
+void CDB_Tile::Set_JP2_Decode_Threads(int Threads)
+{
+	if (Threads <= 0)
+		return;
+	std::stringstream buf;
+	buf << Threads;
+	//JP2OpenJPEG follows GDAL_NUM_THREADS, Kakadu has its own setting
+	CPLSetConfigOption("GDAL_NUM_THREADS", buf.str().c_str());
+	CPLSetConfigOption("JP2KAK_THREADS", buf.str().c_str());
+}
+
+Image_Contrib CDB_Tile::Get_Contribution(CDB_Tile_Extent &TileExtent)
+{
+	//Does the Image fall entirly within the Tile
+	Image_Contrib retval = Image_Is_Inside_Tile(TileExtent);
+	if (retval != None)
+		return retval;
+
+	//Check the tile contents against the Image
+	if ((TileExtent.North < m_TileExtent.South) || (TileExtent.South > m_TileExtent.North) ||
+		(TileExtent.East < m_TileExtent.West) || (TileExtent.West > m_TileExtent.East))
 		retval = None;
 	else if ((TileExtent.North <= m_TileExtent.North) && (TileExtent.South >= m_TileExtent.South) &&
 		(TileExtent.East <= m_TileExtent.East) && (TileExtent.West >= m_TileExtent.West))
@@ -1527,7 +2314,7 @@ bool CDB_Tile::Point_is_Inside_Tile(coord2d &Point, CDB_Tile_Extent &TileExtent)
 		return false;
 }
 
-bool CDB_Tile::Load_Tile(void)
+bool CDB_Tile::Load_Tile(osgEarth::ProgressCallback *progress)
 {
 	if (m_Tile_Status == Loaded)
 		return true;
@@ -1535,17 +2322,165 @@ bool CDB_Tile::Load_Tile(void)
 	if (!m_FileExists)
 		return false;
 
+	if (Is_Cancelled(progress))
+		return false;
+
 	Allocate_Buffers();
 
+	if (m_Subordinate_Component && (m_TileType == Elevation))
+		return Load_Subordinate_Tile(progress);
+
+	if (m_CacheStore)
+		return Read_Cache_Store();
+
 	if (!Open_Tile())
 		return false;
 
-	if (!Read())
+	if (!Read(progress))
 		return false;
 
 	return true;
 }
 
+bool CDB_Tile::Load_Tile_Window(CDB_Tile_Extent &Needed, osgEarth::ProgressCallback *progress)
+{
+	if (m_Tile_Status == Loaded)
+		return true;
+
+	//Only tiles decoded straight from the CDB are read in part
+	if (((m_TileType != Imagery) && (m_TileType != Elevation)) || m_Subordinate_Component || !m_FileExists)
+		return Load_Decoded_Tile(progress);
+
+	if (Is_Cancelled(progress))
+		return false;
+
+	if (!Open_Tile())
+		return false;
+
+	//The source pixels under the overlap plus one for the bilinear filter
+	double west = std::max(Needed.West, m_TileExtent.West);
+	double east = std::min(Needed.East, m_TileExtent.East);
+	double north = std::min(Needed.North, m_TileExtent.North);
+	double south = std::max(Needed.South, m_TileExtent.South);
+	double *transform = m_GDAL.adfGeoTransform;
+	int x0 = std::max((int)floor((west - transform[GEOTRSFRM_TOPLEFT_X]) / transform[GEOTRSFRM_WE_RES]) - 1, 0);
+	int x1 = std::min((int)ceil((east - transform[GEOTRSFRM_TOPLEFT_X]) / transform[GEOTRSFRM_WE_RES]) + 1, m_Pixels.pixX);
+	int y0 = std::max((int)floor((north - transform[GEOTRSFRM_TOPLEFT_Y]) / transform[GEOTRSFRM_NS_RES]) - 1, 0);
+	int y1 = std::min((int)ceil((south - transform[GEOTRSFRM_TOPLEFT_Y]) / transform[GEOTRSFRM_NS_RES]) + 1, m_Pixels.pixY);
+	if ((x1 <= x0) || (y1 <= y0))
+		return Load_Decoded_Tile(progress);
+
+	//A whole decode is shared with the neighbouring keys through the decoded tile
+	//cache, so only small windows are worth reading on their own
+	double window = ((double)(x1 - x0) * (double)(y1 - y0)) / ((double)m_Pixels.pixX * (double)m_Pixels.pixY);
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Decoded_Mutex);
+		double limit = (s_Decoded_Budget > 0) ? CDB_MAX_WINDOW_FRACTION : 1.0;
+		std::stringstream key;
+		key << m_FileName << "#" << m_Pixels.pixX;
+		if ((window >= limit) || (s_Decoded_Tiles.find(key.str()) != s_Decoded_Tiles.end()))
+			return Load_Decoded_Tile(progress);
+	}
+
+	Allocate_Buffers();
+	return Read_Window(x0, y0, x1 - x0, y1 - y0, progress);
+}
+
+bool CDB_Tile::Load_Subordinate_Tile(osgEarth::ProgressCallback *progress)
+{
+	//The primary is read on the composite pool while this thread reads the subordinate
+	osg::ref_ptr<CDB_Primary_Read> primary;
+	if (m_PrimaryExists)
+	{
+		primary = new CDB_Primary_Read(m_PrimaryName, m_Pixels.pixX, m_Pixels.pixY, m_CDB_LOD_Num, progress);
+		if (m_SubordinateExists)
+		{
+			osg::ref_ptr<CDB_Thread_Pool> pool = Composite_Pool();
+			if (pool.valid())
+				pool->Add_Task(primary.get());
+		}
+	}
+
+	if (m_SubordinateExists)
+	{
+		if (!Open_Tile() || !Read(progress))
+		{
+			if (primary.valid())
+				primary->Finish(false);
+			return false;
+		}
+	}
+
+	if (primary.valid())
+	{
+		primary->Finish();
+		//Without the primary the tile would only hold the subordinate's heights, which must
+		//not be returned or kept in the decoded tile cache as the whole tile
+		if (!primary->Loaded)
+			return false;
+	}
+
+	size_t count = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
+	if (!m_SubordinateExists)
+	{
+		memcpy(m_GDAL.elevationdata, primary->Data, count * sizeof(float));
+		for (int i = 0; i < 6; ++i)
+			m_GDAL.adfGeoTransform[i] = primary->GeoTransform[i];
+		m_GDAL.elevationnodata = primary->NoData;
+	}
+	else if (primary.valid())
+	{
+		Overlay_Elevation(m_GDAL.elevationdata, m_GDAL.elevationnodata, primary->Data, primary->NoData, count);
+		m_GDAL.elevationnodata = NO_DATA_VALUE;
+	}
+	m_Tile_Status = Loaded;
+	return true;
+}
+
+CDB_Cache_Store_Tile CDB_Tile::Cache_Store_Layout(void)
+{
+	CDB_Cache_Store_Tile Layout;
+	Layout.Width = m_Pixels.pixX;
+	Layout.Height = m_Pixels.pixY;
+	Layout.Bands = m_Pixels.bands;
+	Layout.Data_Type = m_Pixels.pixType;
+	for (int i = 0; i < 6; ++i)
+		Layout.GeoTransform[i] = m_GDAL.adfGeoTransform[i];
+	return Layout;
+}
+
+bool CDB_Tile::Read_Cache_Store(void)
+{
+	CDB_Cache_Store_Tile Expected = Cache_Store_Layout();
+	size_t BufferSize = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY * (size_t)m_Pixels.bands * (GDALGetDataTypeSize(m_Pixels.pixType) / 8);
+	void *Buffer = (m_TileType == ElevationCache) ? (void *)m_GDAL.elevationdata : (void *)m_GDAL.reddata;
+
+	CDB_Stats_Timer decode_timer(CDB_Stat_Decode, m_CDB_LOD_Num);
+	CDB_Cache_Store_Tile Stored;
+	if (!m_CacheStore->Read(m_CacheKey, Expected, Buffer, BufferSize, Stored))
+		return false;
+
+	for (int i = 0; i < 6; ++i)
+		m_GDAL.adfGeoTransform[i] = Stored.GeoTransform[i];
+	m_Tile_Status = Loaded;
+	return true;
+}
+
+bool CDB_Tile::Write_Cache_Store(void)
+{
+	CDB_Cache_Store_Tile Layout = Cache_Store_Layout();
+	size_t BufferSize = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY * (size_t)m_Pixels.bands * (GDALGetDataTypeSize(m_Pixels.pixType) / 8);
+	const void *Buffer = (m_TileType == ElevationCache) ? (const void *)m_GDAL.elevationdata : (const void *)m_GDAL.reddata;
+	if (!Buffer)
+		return false;
+
+	bool Compress = !m_CacheFormat.Compression.empty() && !EQUAL(m_CacheFormat.Compression.c_str(), "NONE");
+	if (!m_CacheStore->Write(m_CacheKey, Layout, Buffer, BufferSize, Compress))
+		return false;
+	m_FileExists = true;
+	return true;
+}
+
 coord2d CDB_Tile::LL2Pix(coord2d LLPoint)
 {
 	coord2d PixCoord;
@@ -1665,6 +2600,80 @@ bool CDB_Tile::Get_Elevation_Pixel(coord2d ImPix, float &ElevationPix)
 	return true;
 }
 
+void CDB_Tile::Get_Elevations(const coord2d *LLPoints, size_t Count, float *Heights)
+{
+	if ((m_Tile_Status != Loaded) || !m_GDAL.elevationdata)
+	{
+		std::fill(Heights, Heights + Count, NO_DATA_VALUE);
+		return;
+	}
+
+	const int width = m_Pixels.pixX;
+	const int height = m_Pixels.pixY;
+	const float nodata = m_GDAL.elevationnodata;
+#ifdef CDB_TILE_SSE2
+	const __m128 v_nodata = _mm_set1_ps(nodata);
+	const __m128 v_marker = _mm_set1_ps(NO_DATA_VALUE);
+#endif
+	for (size_t i = 0; i < Count; i += 4)
+	{
+		size_t n = std::min((size_t)4, Count - i);
+		float c00[4], c01[4], c10[4], c11[4], wx[4], wy[4], h[4];
+		bool inside[4];
+		for (size_t k = 0; k < 4; ++k)
+		{
+			//Lanes past the end repeat the last point and are dropped
+			coord2d pix = LL2Pix(LLPoints[i + std::min(k, n - 1)]);
+			int tx = (int)floor(pix.Xpos);
+			int ty = (int)floor(pix.Ypos);
+			inside[k] = (tx >= 0) && (tx <= width - 1) && (ty >= 0) && (ty <= height - 1);
+			if (!inside[k])
+			{
+				tx = ty = 0;
+				pix.Xpos = pix.Ypos = 0.0;
+			}
+			int tx1 = (tx < width - 1) ? tx + 1 : tx;
+			int ty1 = (ty < height - 1) ? ty + 1 : ty;
+			const float *row0 = m_GDAL.elevationdata + (size_t)ty * width;
+			const float *row1 = m_GDAL.elevationdata + (size_t)ty1 * width;
+			c00[k] = row0[tx];
+			c01[k] = row0[tx1];
+			c10[k] = row1[tx];
+			c11[k] = row1[tx1];
+			wx[k] = (float)(pix.Xpos - (double)tx);
+			wy[k] = (float)(pix.Ypos - (double)ty);
+		}
+#ifdef CDB_TILE_SSE2
+		__m128 a = _mm_loadu_ps(c00);
+		__m128 b = _mm_loadu_ps(c01);
+		__m128 c = _mm_loadu_ps(c10);
+		__m128 d = _mm_loadu_ps(c11);
+		__m128 fx = _mm_loadu_ps(wx);
+		__m128 top = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), fx));
+		__m128 bottom = _mm_add_ps(c, _mm_mul_ps(_mm_sub_ps(d, c), fx));
+		__m128 v = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), _mm_loadu_ps(wy)));
+		__m128 valid = _mm_and_ps(_mm_and_ps(Valid_Elevation_Mask(a, v_nodata), Valid_Elevation_Mask(b, v_nodata)),
+								  _mm_and_ps(Valid_Elevation_Mask(c, v_nodata), Valid_Elevation_Mask(d, v_nodata)));
+		_mm_storeu_ps(h, _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, v_marker)));
+#else
+		for (size_t k = 0; k < 4; ++k)
+		{
+			if (Valid_Elevation(c00[k], nodata) && Valid_Elevation(c01[k], nodata) &&
+				Valid_Elevation(c10[k], nodata) && Valid_Elevation(c11[k], nodata))
+			{
+				float top = c00[k] + (c01[k] - c00[k]) * wx[k];
+				float bottom = c10[k] + (c11[k] - c10[k]) * wx[k];
+				h[k] = top + (bottom - top) * wy[k];
+			}
+			else
+				h[k] = NO_DATA_VALUE;
+		}
+#endif
+		for (size_t k = 0; k < n; ++k)
+			Heights[i + k] = inside[k] ? h[k] : NO_DATA_VALUE;
+	}
+}
+
 double CDB_Tile::West(void)
 {
 	return m_TileExtent.West;
@@ -1685,16 +2694,182 @@ double CDB_Tile::South(void)
 	return m_TileExtent.South;
 }
 
-void CDB_Tile::Build_From_Tiles(CDB_TilePV *Tiles, bool from_scratch)
+bool CDB_Tile::Composite_Sub_Tile(CDB_Tile *tile, osgEarth::ProgressCallback *progress, double &decode_secs)
 {
+	Image_Contrib ImageContrib = tile->Get_Contribution(m_TileExtent);
+	if ((ImageContrib != Full) && (ImageContrib != Partial))
+		return false;
+
+	osg::Timer_t load_start = osg::Timer::instance()->tick();
+	bool loaded = tile->Load_Tile_Window(m_TileExtent, progress);
+	if (loaded)
+	{
+		decode_secs += osg::Timer::instance()->delta_s(load_start, osg::Timer::instance()->tick());
+		CDB_Stats_Timer resample_timer(CDB_Stat_Resample, m_CDB_LOD_Num);
+		double XRes = (m_TileExtent.East - m_TileExtent.West) / (double)m_Pixels.pixX;
+		double YRes = (m_TileExtent.North - m_TileExtent.South) / (double)m_Pixels.pixY;
+		//Each pixel belongs to exactly one sub-tile (north and west edges in, south and
+		//east edges out) so sub-tiles can be written from several threads at once
+		int sy = (int)ceil(((m_TileExtent.North - tile->North()) / YRes) - 1e-6);
+		if (sy < 0)
+			sy = 0;
+		int ey = (int)ceil(((m_TileExtent.North - tile->South()) / YRes) - 1e-6) - 1;
+		if (ey > m_Pixels.pixY - 1)
+			ey = m_Pixels.pixY - 1;
+		int sx = (int)ceil(((tile->West() - m_TileExtent.West) / XRes) - 1e-6);
+		if (sx < 0)
+			sx = 0;
+		int ex = (int)ceil(((tile->East() - m_TileExtent.West) / XRes) - 1e-6) - 1;
+		if (ex > m_Pixels.pixX - 1)
+			ex = m_Pixels.pixX - 1;
+
+		double srowlon = m_TileExtent.West + ((double)sx * XRes);
+		double srowlat = m_TileExtent.North - ((double)sy *  YRes);
+		if ((ex < sx) || (ey < sy))
+		{
+			tile->Free_Resources();
+			return loaded;
+		}
+
+		//Every destination row samples the same source columns and every column the
+		//same source rows, so the sample positions are worked out once per build
+		CDB_Sample_IndexV cols(ex - sx + 1);
+		CDB_Sample_IndexV rows(ey - sy + 1);
+		coord2d clatlon(srowlon, srowlat);
+		bool aligned = true;
+		bool exact = true;
+		for (int ix = sx; ix <= ex; ++ix)
+		{
+			CDB_Sample_Index &col = cols[ix - sx];
+			col.Set(tile->LL2Pix(clatlon).Xpos, tile->m_Pixels.pixX, 1);
+			aligned = aligned && col.Valid && (col.Weight1 == 0.0f);
+			exact = exact && ((ix == sx) || (col.Pos0 == cols[ix - sx - 1].Pos0 + 1));
+			clatlon.Xpos += XRes;
+		}
+		clatlon.Xpos = srowlon;
+		for (int iy = sy; iy <= ey; ++iy)
+		{
+			CDB_Sample_Index &row = rows[iy - sy];
+			row.Set(tile->LL2Pix(clatlon).Ypos, tile->m_Pixels.pixY, tile->m_Pixels.pixX);
+			aligned = aligned && (row.Weight1 == 0.0f);
+			clatlon.Ypos -= YRes;
+		}
+		exact = exact && aligned;
+
+		bool imagery = (m_TileType == Imagery) || (m_TileType == ImageryCache);
+		int width = ex - sx + 1;
+		for (int iy = sy; iy <= ey; ++iy)
+		{
+			CDB_Sample_Index &row = rows[iy - sy];
+			if (!row.Valid)
+				continue;
+			int buffloc = (iy * m_Pixels.pixX) + sx;
+			if (exact)
+			{
+				//The destination grid lands on the source pixels, copy the run
+				int srcloc = row.Pos0 + cols[0].Pos0;
+				if (imagery)
+				{
+					memcpy(&m_GDAL.reddata[buffloc], &tile->m_GDAL.reddata[srcloc], width);
+					memcpy(&m_GDAL.greendata[buffloc], &tile->m_GDAL.greendata[srcloc], width);
+					memcpy(&m_GDAL.bluedata[buffloc], &tile->m_GDAL.bluedata[srcloc], width);
+				}
+				else
+					memcpy(&m_GDAL.elevationdata[buffloc], &tile->m_GDAL.elevationdata[srcloc], width * sizeof(float));
+				continue;
+			}
+			if (aligned)
+			{
+				//Every destination pixel is a source pixel (i.e. 2:1 decimation)
+				if (imagery)
+				{
+					const unsigned char *r0 = &tile->m_GDAL.reddata[row.Pos0];
+					const unsigned char *g0 = &tile->m_GDAL.greendata[row.Pos0];
+					const unsigned char *b0 = &tile->m_GDAL.bluedata[row.Pos0];
+					for (int c = 0; c < width; ++c, ++buffloc)
+					{
+						m_GDAL.reddata[buffloc] = r0[cols[c].Pos0];
+						m_GDAL.greendata[buffloc] = g0[cols[c].Pos0];
+						m_GDAL.bluedata[buffloc] = b0[cols[c].Pos0];
+					}
+				}
+				else
+				{
+					const float *e0 = &tile->m_GDAL.elevationdata[row.Pos0];
+					for (int c = 0; c < width; ++c, ++buffloc)
+						m_GDAL.elevationdata[buffloc] = e0[cols[c].Pos0];
+				}
+				continue;
+			}
+
+			float rat4 = row.Weight1;
+			float rat3 = row.Weight0;
+			if (imagery)
+			{
+				const unsigned char *r0 = &tile->m_GDAL.reddata[row.Pos0];
+				const unsigned char *r1 = &tile->m_GDAL.reddata[row.Pos1];
+				const unsigned char *g0 = &tile->m_GDAL.greendata[row.Pos0];
+				const unsigned char *g1 = &tile->m_GDAL.greendata[row.Pos1];
+				const unsigned char *b0 = &tile->m_GDAL.bluedata[row.Pos0];
+				const unsigned char *b1 = &tile->m_GDAL.bluedata[row.Pos1];
+				for (int c = 0; c < width; ++c, ++buffloc)
+				{
+					CDB_Sample_Index &col = cols[c];
+					if (!col.Valid)
+						continue;
+					float rat1 = col.Weight0;
+					float rat2 = col.Weight1;
+					float p1p = ((float)r0[col.Pos0] * rat1) + ((float)r0[col.Pos1] * rat2);
+					float p2p = ((float)r1[col.Pos0] * rat1) + ((float)r1[col.Pos1] * rat2);
+					float red = round((p1p * rat3) + (p2p * rat4));
+					p1p = ((float)g0[col.Pos0] * rat1) + ((float)g0[col.Pos1] * rat2);
+					p2p = ((float)g1[col.Pos0] * rat1) + ((float)g1[col.Pos1] * rat2);
+					float green = round((p1p * rat3) + (p2p * rat4));
+					p1p = ((float)b0[col.Pos0] * rat1) + ((float)b0[col.Pos1] * rat2);
+					p2p = ((float)b1[col.Pos0] * rat1) + ((float)b1[col.Pos1] * rat2);
+					float blue = round((p1p * rat3) + (p2p * rat4));
+					m_GDAL.reddata[buffloc] = (unsigned char)(red < 255.0f ? red : 255.0f);
+					m_GDAL.greendata[buffloc] = (unsigned char)(green < 255.0f ? green : 255.0f);
+					m_GDAL.bluedata[buffloc] = (unsigned char)(blue < 255.0f ? blue : 255.0f);
+				}
+			}
+			else
+			{
+				const float *e0 = &tile->m_GDAL.elevationdata[row.Pos0];
+				const float *e1 = &tile->m_GDAL.elevationdata[row.Pos1];
+				for (int c = 0; c < width; ++c, ++buffloc)
+				{
+					CDB_Sample_Index &col = cols[c];
+					if (!col.Valid)
+						continue;
+					float e1p = (e0[col.Pos0] * col.Weight0) + (e0[col.Pos1] * col.Weight1);
+					float e2p = (e1[col.Pos0] * col.Weight0) + (e1[col.Pos1] * col.Weight1);
+					m_GDAL.elevationdata[buffloc] = (e1p * rat3) + (e2p * rat4);
+				}
+			}
+		}
+	}
+	tile->Free_Resources();
+	return loaded;
+}
+
+bool CDB_Tile::Build_From_Tiles(CDB_TilePV *Tiles, bool from_scratch, osgEarth::ProgressCallback *progress)
+{
+	if (Is_Cancelled(progress))
+		return false;
 
 	Allocate_Buffers();
 
 	if (!from_scratch && m_FileExists)
 	{
-		Open_Tile();
 		//Load the current tile Information
-		Read();
+		if (m_CacheStore)
+			Read_Cache_Store();
+		else
+		{
+			Open_Tile();
+			Read(progress);
+		}
 	}
 	else
 	{
@@ -1702,76 +2877,66 @@ void CDB_Tile::Build_From_Tiles(CDB_TilePV *Tiles, bool from_scratch)
 	}
 
 	bool have_some_contribution = false;
-	double XRes = (m_TileExtent.East - m_TileExtent.West) / (double)m_Pixels.pixX;
-	double YRes = (m_TileExtent.North - m_TileExtent.South) / (double)m_Pixels.pixY;
-	for each (CDB_TileP tile in *Tiles)
+	bool cancelled = false;
+	osg::ref_ptr<CDB_Thread_Pool> pool;
+	if (Tiles->size() > 1)
+		pool = Composite_Pool();
+	if (pool.valid())
+	{
+		//The requesting thread reads sub-tiles along with the helpers so the
+		//build never waits on a busy pool
+		osg::ref_ptr<CDB_Composite_Build> build = new CDB_Composite_Build(this, Tiles, progress);
+		int helpers = std::min(pool->Thread_Count(), (int)Tiles->size() - 1);
+		for (int h = 0; h < helpers; ++h)
+			pool->Add_Task(new CDB_Composite_Task(build.get()));
+		build->Work();
+		build->Wait();
+		have_some_contribution = build->Have_Contribution();
+		cancelled = build->Cancelled();
+		if (cancelled)
+			Record_Cancel(build->Decode_Secs(), build->Skipped());
+	}
+	else
 	{
-		Image_Contrib ImageContrib = tile->Get_Contribution(m_TileExtent);
-		if ((ImageContrib == Full) || (ImageContrib == Partial))
+		double build_decode_secs = 0.0;
+		for (size_t ti = 0; ti < Tiles->size(); ++ti)
 		{
-			if (tile->Load_Tile())
+			if (Is_Cancelled(progress))
 			{
-				have_some_contribution = true;
-				int sy = (int)((m_TileExtent.North - tile->North()) / YRes);
-				if (sy < 0)
-					sy = 0;
-				int ey = (int)((m_TileExtent.North - tile->South()) / YRes);
-				if (ey > m_Pixels.pixY - 1)
-					ey = m_Pixels.pixY - 1;
-				int sx = (int)((tile->West() - m_TileExtent.West) / XRes);
-				if (sx < 0)
-					sx = 0;
-				int ex = (int)((tile->East() - m_TileExtent.West) / XRes);
-				if (ex > m_Pixels.pixX - 1)
-					ex = m_Pixels.pixX - 1;
-
-				double srowlon = m_TileExtent.West + ((double)sx * XRes);
-				double srowlat = m_TileExtent.North - ((double)sy *  YRes);
-				int buffloc = 0;
-				coord2d clatlon;
-				clatlon.Ypos = srowlat;
-				for (int iy = sy; iy <= ey; ++iy)
+				//Count the decodes we are not going to do
+				int skipped = 0;
+				for (size_t si = ti; si < Tiles->size(); ++si)
 				{
-					buffloc = (iy * m_Pixels.pixX) + sx;
-					clatlon.Xpos = srowlon;
-					for (int ix = sx; ix <= ex; ++ix)
-					{
-						coord2d impix = tile->LL2Pix(clatlon);
-						if ((m_TileType == Imagery) || (m_TileType == ImageryCache))
-						{
-							unsigned char redpix, greenpix, bluepix;
-							if (tile->Get_Image_Pixel(impix, redpix, greenpix, bluepix))
-							{
-								m_GDAL.reddata[buffloc] = redpix;
-								m_GDAL.greendata[buffloc] = greenpix;
-								m_GDAL.bluedata[buffloc] = bluepix;
-							}
-						}
-						else if ((m_TileType == Elevation) || (m_TileType == ElevationCache))
-						{
-							tile->Get_Elevation_Pixel(impix, m_GDAL.elevationdata[buffloc]);
-						}
-						++buffloc;
-						clatlon.Xpos += XRes;
-					}
-					clatlon.Ypos -= YRes;
+					Image_Contrib SkipContrib = Tiles->at(si)->Get_Contribution(m_TileExtent);
+					if ((SkipContrib == Full) || (SkipContrib == Partial))
+						++skipped;
 				}
+				Record_Cancel(build_decode_secs, skipped);
+				cancelled = true;
+				break;
 			}
-			tile->Free_Resources();
-
+			if (Composite_Sub_Tile(Tiles->at(ti), progress, build_decode_secs))
+				have_some_contribution = true;
 		}
 	}
 
+	if (cancelled)
+	{
+		Free_Buffers();
+		return false;
+	}
+
 	if (have_some_contribution)
 	{
 		m_Tile_Status = Loaded;
 	}
-
+	return have_some_contribution;
 }
 
-bool CDB_Tile::Save(void)
+bool CDB_Tile::Save(osgEarth::ProgressCallback *progress)
 {
-	char **papszOptions = NULL;
+	if (Is_Cancelled(progress))
+		return false;
 
 	//Set the transformation Matrix
 	m_GDAL.adfGeoTransform[0] = m_TileExtent.West;
@@ -1781,6 +2946,13 @@ bool CDB_Tile::Save(void)
 	m_GDAL.adfGeoTransform[4] = 0.0;
 	m_GDAL.adfGeoTransform[5] = ((m_TileExtent.North - m_TileExtent.South) / (double)m_Pixels.pixY) * -1.0;
 
+	CDB_Stats_Timer write_timer(CDB_Stat_Cache_Write, m_CDB_LOD_Num);
+	if (m_CacheStore)
+		return Write_Cache_Store();
+
+	bool elevation_hfa = (m_TileType == ElevationCache) && !m_CacheFormat.Elevation_GTiff;
+	char **papszOptions = Cache_Creation_Options(elevation_hfa);
+
 	OGRSpatialReference *CDB_SRS = new OGRSpatialReference();
 	CDB_SRS->SetWellKnownGeogCS("WGS84");
 	if (m_GDAL.poDataset)
@@ -1788,6 +2960,10 @@ bool CDB_Tile::Save(void)
 		Close_Dataset();
 	}
 
+	//Write to a temporary file and rename it into place once it is complete
+	//so a concurrent reader never opens a partially written cache tile
+	std::string TempName = Temp_Cache_Name(m_FileName);
+
 
 	if (m_TileType == ImageryCache)
 	{
@@ -1798,14 +2974,16 @@ bool CDB_Tile::Save(void)
 			GDALDataType dataType = GDT_Byte;
 			if (!m_GDAL.poDriver)
 			{
+				CSLDestroy(papszOptions);
 				delete CDB_SRS;
 				return false;
 			}
 			//Create the file
-			m_GDAL.poDataset = m_GDAL.poDriver->Create(m_FileName.c_str(), m_Pixels.pixX, m_Pixels.pixY, m_Pixels.bands, dataType, papszOptions);
+			m_GDAL.poDataset = m_GDAL.poDriver->Create(TempName.c_str(), m_Pixels.pixX, m_Pixels.pixY, m_Pixels.bands, dataType, papszOptions);
 
 			if (!m_GDAL.poDataset)
 			{
+				CSLDestroy(papszOptions);
 				delete CDB_SRS;
 				return false;
 			}
@@ -1817,9 +2995,13 @@ bool CDB_Tile::Save(void)
 			CPLFree(projection);
 		}
 		//Write the elevation data to the file
-		if (!Write())
+		if (!Write(progress))
 		{
+			CSLDestroy(papszOptions);
 			delete CDB_SRS;
+			GDALClose(m_GDAL.poDataset);
+			m_GDAL.poDataset = NULL;
+			VSIUnlink(TempName.c_str());
 			return false;
 		}
 	}
@@ -1828,18 +3010,23 @@ bool CDB_Tile::Save(void)
 		if (m_GDAL.poDataset == NULL)
 		{
 			//Get the Imagine Driver
-			m_GDAL.poDriver = Gbl_TileDrivers.cdb_HFADriver;
+			if (elevation_hfa)
+				m_GDAL.poDriver = Gbl_TileDrivers.cdb_HFADriver;
+			else
+				m_GDAL.poDriver = Gbl_TileDrivers.cdb_GTIFFDriver;
 			GDALDataType dataType = GDT_Float32;
 			if (!m_GDAL.poDriver)
 			{
+				CSLDestroy(papszOptions);
 				delete CDB_SRS;
 				return false;
 			}
 			//Create the file
-			m_GDAL.poDataset = m_GDAL.poDriver->Create(m_FileName.c_str(), m_Pixels.pixX, m_Pixels.pixY, m_Pixels.bands, dataType, papszOptions);
+			m_GDAL.poDataset = m_GDAL.poDriver->Create(TempName.c_str(), m_Pixels.pixX, m_Pixels.pixY, m_Pixels.bands, dataType, papszOptions);
 
 			if (!m_GDAL.poDataset)
 			{
+				CSLDestroy(papszOptions);
 				delete CDB_SRS;
 				return false;
 			}
@@ -1850,18 +3037,152 @@ bool CDB_Tile::Save(void)
 			CPLFree(projection);
 		}
 		//Write the elevation data to the file
-		if (!Write())
+		if (!Write(progress))
 		{
+			CSLDestroy(papszOptions);
 			delete CDB_SRS;
+			GDALClose(m_GDAL.poDataset);
+			m_GDAL.poDataset = NULL;
+			VSIUnlink(TempName.c_str());
 			return false;
 		}
 	}
 
+	CSLDestroy(papszOptions);
 	delete CDB_SRS;
+
+	if (m_GDAL.poDataset)
+	{
+		if (m_CacheFormat.Overviews)
+			Build_Cache_Overviews();
+
+		//The file has to be closed before it can be moved, the buffers stay loaded
+		GDALClose(m_GDAL.poDataset);
+		m_GDAL.poDataset = NULL;
+		if (!Rename_Cache_File(TempName, m_FileName))
+		{
+			VSIUnlink(TempName.c_str());
+			return false;
+		}
+	}
 	return true;
 }
 
-bool CDB_Tile::Write(void)
+char ** CDB_Tile::Cache_Creation_Options(bool HFA)
+{
+	char **papszOptions = NULL;
+	bool elevation = (m_TileType == ElevationCache);
+	std::string compression = m_CacheFormat.Compression;
+	for (size_t i = 0; i < compression.size(); ++i)
+		compression[i] = (char)toupper(compression[i]);
+
+	if (HFA)
+	{
+		//Erdas Imagine only supports run length compression
+		if (!compression.empty() && (compression != "NONE"))
+			papszOptions = CSLSetNameValue(papszOptions, "COMPRESSED", "YES");
+	}
+	else
+	{
+		if ((compression == "JPEG") && elevation)
+		{
+			OE_WARN "CDB cache JPEG compression is not supported for elevation, using DEFLATE" << std::endl;
+			compression = "DEFLATE";
+		}
+
+		if (!compression.empty() && (compression != "NONE"))
+		{
+			papszOptions = CSLSetNameValue(papszOptions, "COMPRESS", compression.c_str());
+
+			bool lerc = (compression.compare(0, 4, "LERC") == 0);
+			if (compression == "JPEG")
+			{
+				papszOptions = CSLSetNameValue(papszOptions, "PHOTOMETRIC", "YCBCR");
+				if (m_CacheFormat.Level > 0)
+				{
+					std::stringstream quality;
+					quality << m_CacheFormat.Level;
+					papszOptions = CSLSetNameValue(papszOptions, "JPEG_QUALITY", quality.str().c_str());
+				}
+			}
+			else if (!lerc)
+			{
+				//Horizontal differencing for imagery, floating point prediction for elevation
+				int predictor = m_CacheFormat.Predictor;
+				if (predictor == 0)
+					predictor = elevation ? 3 : 2;
+				if (predictor > 1)
+				{
+					std::stringstream pred;
+					pred << predictor;
+					papszOptions = CSLSetNameValue(papszOptions, "PREDICTOR", pred.str().c_str());
+				}
+			}
+
+			if (lerc && elevation)
+			{
+				std::stringstream zerror;
+				zerror << m_CacheFormat.Max_Z_Error;
+				papszOptions = CSLSetNameValue(papszOptions, "MAX_Z_ERROR", zerror.str().c_str());
+			}
+
+			if (m_CacheFormat.Level > 0)
+			{
+				std::stringstream level;
+				level << m_CacheFormat.Level;
+				if ((compression == "DEFLATE") || (compression == "LERC_DEFLATE"))
+					papszOptions = CSLSetNameValue(papszOptions, "ZLEVEL", level.str().c_str());
+				else if ((compression == "ZSTD") || (compression == "LERC_ZSTD"))
+					papszOptions = CSLSetNameValue(papszOptions, "ZSTD_LEVEL", level.str().c_str());
+			}
+		}
+
+		if (m_CacheFormat.Tiled)
+		{
+			std::stringstream block;
+			block << m_CacheFormat.Block_Size;
+			papszOptions = CSLSetNameValue(papszOptions, "TILED", "YES");
+			papszOptions = CSLSetNameValue(papszOptions, "BLOCKXSIZE", block.str().c_str());
+			papszOptions = CSLSetNameValue(papszOptions, "BLOCKYSIZE", block.str().c_str());
+		}
+	}
+
+	//Anything else is passed straight through to the driver
+	std::string extra = m_CacheFormat.Creation_Options;
+	size_t start = 0;
+	while (start < extra.size())
+	{
+		size_t end = extra.find(';', start);
+		if (end == std::string::npos)
+			end = extra.size();
+		std::string option = extra.substr(start, end - start);
+		size_t eqpos = option.find('=');
+		if ((eqpos != std::string::npos) && (eqpos > 0))
+			papszOptions = CSLSetNameValue(papszOptions, option.substr(0, eqpos).c_str(), option.substr(eqpos + 1).c_str());
+		start = end + 1;
+	}
+
+	return papszOptions;
+}
+
+void CDB_Tile::Build_Cache_Overviews(void)
+{
+	//Reduced resolution levels down to 64 pixels
+	int levels[8];
+	int levelcnt = 0;
+	for (int factor = 2; (levelcnt < 8) && (m_Pixels.pixX / factor >= 64) && (m_Pixels.pixY / factor >= 64); factor *= 2)
+		levels[levelcnt++] = factor;
+
+	if (levelcnt == 0)
+		return;
+
+	if (m_GDAL.poDataset->BuildOverviews("AVERAGE", levelcnt, levels, 0, NULL, NULL, NULL) == CE_Failure)
+	{
+		OE_WARN "CDB failed to build cache overviews for " << m_FileName << std::endl;
+	}
+}
+
+bool CDB_Tile::Write(osgEarth::ProgressCallback *progress)
 {
 	CPLErr gdal_err;
 
@@ -1872,13 +3193,13 @@ bool CDB_Tile::Write(void)
 		GDALRasterBand * BlueBand = m_GDAL.poDataset->GetRasterBand(3);
 
 		gdal_err = RedBand->RasterIO(GF_Write, 0, 0, m_Pixels.pixX, m_Pixels.pixY, m_GDAL.reddata, m_Pixels.pixX, m_Pixels.pixY, GDT_Byte, 0, 0);
-		if (gdal_err == CE_Failure)
+		if ((gdal_err == CE_Failure) || Is_Cancelled(progress))
 		{
 			return false;
 		}
 
 		gdal_err = GreenBand->RasterIO(GF_Write, 0, 0, m_Pixels.pixX, m_Pixels.pixY, m_GDAL.greendata, m_Pixels.pixX, m_Pixels.pixY, GDT_Byte, 0, 0);
-		if (gdal_err == CE_Failure)
+		if ((gdal_err == CE_Failure) || Is_Cancelled(progress))
 		{
 			return false;
 		}
@@ -1899,6 +3220,181 @@ bool CDB_Tile::Write(void)
 			return false;
 		}
 	}
+
+	//Store the value of a constant tile so reading it back skips the decode
+	if (Is_Constant())
+	{
+		if (m_TileType == ImageryCache)
+		{
+			double values[3] = { (double)m_GDAL.reddata[0], (double)m_GDAL.greendata[0], (double)m_GDAL.bluedata[0] };
+			for (int b = 0; b < 3; ++b)
+				m_GDAL.poDataset->GetRasterBand(b + 1)->SetStatistics(values[b], values[b], values[b], 0.0);
+		}
+		else if ((m_TileType == ElevationCache) && Valid_Elevation(m_GDAL.elevationdata[0], NO_DATA_VALUE))
+		{
+			double value = m_GDAL.elevationdata[0];
+			m_GDAL.poDataset->GetRasterBand(1)->SetStatistics(value, value, value, 0.0);
+		}
+	}
+	return true;
+}
+
+bool CDB_Tile::Is_Cancelled(osgEarth::ProgressCallback *progress)
+{
+	return progress && progress->isCanceled();
+}
+
+void CDB_Tile::Record_Decode(double Secs)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Cancel_Stats_Mutex);
+	++s_Cancel_Stats.Decodes;
+	s_Cancel_Stats.Decode_Secs += Secs;
+}
+
+void CDB_Tile::Record_Wasted(double Wasted_Secs)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Cancel_Stats_Mutex);
+	s_Cancel_Stats.Wasted_Secs += Wasted_Secs;
+}
+
+void CDB_Tile::Record_Cancel(double Wasted_Secs, int Skipped_Decodes)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Cancel_Stats_Mutex);
+	++s_Cancel_Stats.Cancelled_Builds;
+	s_Cancel_Stats.Wasted_Secs += Wasted_Secs;
+	//Estimate what the skipped decodes would have cost from the decodes we have done
+	if ((Skipped_Decodes > 0) && (s_Cancel_Stats.Decodes > 0))
+		s_Cancel_Stats.Saved_Secs += (double)Skipped_Decodes * (s_Cancel_Stats.Decode_Secs / (double)s_Cancel_Stats.Decodes);
+}
+
+CDB_Cancel_Stats CDB_Tile::Get_Cancel_Stats(void)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Cancel_Stats_Mutex);
+	return s_Cancel_Stats;
+}
+
+void CDB_Tile::Set_Composite_Threads(int NumThreads)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Composite_Mutex);
+	if (NumThreads == s_Composite_Threads)
+		return;
+	s_Composite_Threads = NumThreads;
+	//Builds still using the old pool finish their sub-tiles themselves
+	if (s_Composite_Pool.valid())
+		s_Composite_Pool->Shutdown();
+	s_Composite_Pool = NULL;
+}
+
+void CDB_Tile::Set_Decoded_Cache_Size(int MegaBytes)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Decoded_Mutex);
+	s_Decoded_Budget = (MegaBytes > 0) ? (size_t)MegaBytes * 1024 * 1024 : 0;
+	Trim_Decoded_Tiles();
+}
+
+bool CDB_Tile::Load_Decoded_Tile(osgEarth::ProgressCallback *progress)
+{
+	if (m_Tile_Status == Loaded)
+		return true;
+
+	if ((m_TileType != Imagery) && (m_TileType != Elevation))
+		return Load_Tile(progress);
+
+	//Layers reading the tile at different sizes keep their own copy
+	std::stringstream keybuf;
+	keybuf << m_FileName << "#" << m_Pixels.pixX;
+	std::string key = keybuf.str();
+
+	osg::ref_ptr<CDB_Decoded_Tile> decoded;
+	bool leader = false;
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Decoded_Mutex);
+		if (s_Decoded_Budget == 0)
+			decoded = NULL;
+		else
+		{
+			CDB_Decoded_TileMap::iterator di = s_Decoded_Tiles.find(key);
+			if (di == s_Decoded_Tiles.end())
+			{
+				decoded = new CDB_Decoded_Tile;
+				s_Decoded_Tiles[key] = decoded;
+				s_Decoded_Order.push_front(key);
+				leader = true;
+			}
+			else
+			{
+				decoded = di->second;
+				s_Decoded_Order.remove(key);
+				s_Decoded_Order.push_front(key);
+				//Another key is decoding this tile, wait for it rather than decode it twice
+				while (!decoded->Ready && !decoded->Failed && !Is_Cancelled(progress))
+					s_Decoded_Done.wait(&s_Decoded_Mutex, 100);
+			}
+		}
+	}
+
+	if (!decoded.valid())
+		return Load_Tile(progress);
+
+	if (leader)
+	{
+		bool loaded = Load_Tile(progress);
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_Decoded_Mutex);
+		if (loaded)
+		{
+			//Hand the buffers to the cache and borrow them back
+			size_t bandbuffersize = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
+			if (m_TileType == Imagery)
+			{
+				decoded->Image_Data = m_GDAL.reddata;
+				decoded->Bytes = bandbuffersize * 3;
+			}
+			else
+			{
+				decoded->Elevation_Data = m_GDAL.elevationdata;
+				decoded->Elevation_NoData = m_GDAL.elevationnodata;
+				decoded->Bytes = bandbuffersize * sizeof(float);
+			}
+			for (int i = 0; i < 6; ++i)
+				decoded->GeoTransform[i] = m_GDAL.adfGeoTransform[i];
+			decoded->Ready = true;
+			m_Decoded = decoded;
+			s_Decoded_Bytes += decoded->Bytes;
+			Trim_Decoded_Tiles();
+		}
+		else
+		{
+			decoded->Failed = true;
+			CDB_Decoded_TileMap::iterator di = s_Decoded_Tiles.find(key);
+			if ((di != s_Decoded_Tiles.end()) && (di->second == decoded))
+				s_Decoded_Tiles.erase(di);
+			s_Decoded_Order.remove(key);
+		}
+		s_Decoded_Done.broadcast();
+		return loaded;
+	}
+
+	//The decode we waited on was cancelled or failed, do our own
+	if (!decoded->Ready)
+		return Load_Tile(progress);
+
+	Free_Buffers();
+	m_Decoded = decoded;
+	size_t bandbuffersize = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
+	if (m_TileType == Imagery)
+	{
+		m_GDAL.reddata = decoded->Image_Data;
+		m_GDAL.greendata = m_GDAL.reddata + bandbuffersize;
+		m_GDAL.bluedata = m_GDAL.greendata + bandbuffersize;
+	}
+	else
+	{
+		m_GDAL.elevationdata = decoded->Elevation_Data;
+		m_GDAL.elevationnodata = decoded->Elevation_NoData;
+	}
+	for (int i = 0; i < 6; ++i)
+		m_GDAL.adfGeoTransform[i] = decoded->GeoTransform[i];
+	m_Tile_Status = Loaded;
 	return true;
 }
 
@@ -1906,6 +3402,7 @@ osg::Image* CDB_Tile::Image_From_Tile(void)
 {
 	if (m_Tile_Status == Loaded)
 	{
+		CDB_Stats_Timer convert_timer(CDB_Stat_Convert, m_CDB_LOD_Num);
 		//allocate the osg image
 		osg::ref_ptr<osg::Image> image = new osg::Image;
 		GLenum pixelFormat = GL_RGBA;
@@ -1935,35 +3432,122 @@ osg::Image* CDB_Tile::Image_From_Tile(void)
 		return NULL;
 }
 
+osg::Image* CDB_Tile::Compressed_Image_From_Tile(bool Mipmaps)
+{
+	if ((m_Tile_Status == Loaded) && m_GDAL.reddata)
+	{
+		CDB_Stats_Timer convert_timer(CDB_Stat_Convert, m_CDB_LOD_Num);
+		osg::Image * image = CDB_DXT::Compress_RGB(m_GDAL.reddata, m_GDAL.greendata, m_GDAL.bluedata,
+												   m_Pixels.pixX, m_Pixels.pixY, Mipmaps);
+		if (image)
+			return image;
+	}
+	return Image_From_Tile();
+}
+
+//True when the Count bytes all equal the first
+static bool Uniform_Bytes(const unsigned char *Data, size_t Count)
+{
+	size_t i = 0;
+#ifdef CDB_TILE_SSE2
+	const __m128i first = _mm_set1_epi8((char)Data[0]);
+	for (; i + 16 <= Count; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(Data + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) != 0xffff)
+			return false;
+	}
+#endif
+	for (; i < Count; ++i)
+	{
+		if (Data[i] != Data[0])
+			return false;
+	}
+	return true;
+}
+
+bool CDB_Tile::Is_Constant(void)
+{
+	if (m_Tile_Status != Loaded)
+		return false;
+	size_t buffsz = (size_t)m_Pixels.pixX * (size_t)m_Pixels.pixY;
+	if (m_GDAL.reddata)
+	{
+		return Uniform_Bytes(m_GDAL.reddata, buffsz) && Uniform_Bytes(m_GDAL.greendata, buffsz) &&
+			   Uniform_Bytes(m_GDAL.bluedata, buffsz);
+	}
+	else if (m_GDAL.elevationdata)
+	{
+		//Compared bit for bit so a tile of nodata NaNs counts as constant
+		const unsigned char *bytes = (const unsigned char *)m_GDAL.elevationdata;
+		return (memcmp(bytes, bytes + sizeof(float), (buffsz - 1) * sizeof(float)) == 0);
+	}
+	return false;
+}
+
+osg::Image* CDB_Tile::Constant_Image(void)
+{
+	if ((m_Tile_Status != Loaded) || !m_GDAL.reddata)
+		return NULL;
+
+	//Not shared, image layer operations such as transparent_color change the pixels in place
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->allocateImage(1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+	unsigned char *pixel = image->data();
+	pixel[0] = m_GDAL.reddata[0];
+	pixel[1] = m_GDAL.greendata[0];
+	pixel[2] = m_GDAL.bluedata[0];
+	pixel[3] = 255;
+	return image.release();
+}
+
+osg::HeightField* CDB_Tile::Constant_HeightField(void)
+{
+	if ((m_Tile_Status != Loaded) || !m_GDAL.elevationdata)
+		return NULL;
+
+	//Not shared, osgEarth sets the origin and intervals of each tile's heightfield
+	float height = m_GDAL.elevationdata[0];
+	if (!Valid_Elevation(height, m_GDAL.elevationnodata))
+		height = NO_DATA_VALUE;
+	osg::ref_ptr<osg::HeightField> field = new osg::HeightField;
+	field->allocate(2, 2);
+	std::fill(field->getHeightList().begin(), field->getHeightList().end(), height);
+	return field.release();
+}
+
 osg::HeightField* CDB_Tile::HeightField_From_Tile(void)
 {
 	if (m_Tile_Status == Loaded)
 	{
+		CDB_Stats_Timer convert_timer(CDB_Stat_Convert, m_CDB_LOD_Num);
 		osg::ref_ptr<osg::HeightField> field = new osg::HeightField;
 		field->allocate(m_Pixels.pixX, m_Pixels.pixY);
-		//For now clear the data
-		for (unsigned int i = 0; i < field->getHeightList().size(); ++i)
-			field->getHeightList()[i] = NO_DATA_VALUE;
 
-		int ibpos = 0;
-		for (unsigned int r = 0; r < (unsigned)m_Pixels.pixY; r++)
+		//One pass that flips the rows and marks the band nodata, NaN and out of range
+		//heights with the universal NO_DATA_VALUE marker
+		const float nodata = m_GDAL.elevationnodata;
+		float *heights = &field->getHeightList()[0];
+		int width = m_Pixels.pixX;
+#ifdef CDB_TILE_SSE2
+		const __m128 v_nodata = _mm_set1_ps(nodata);
+		const __m128 v_marker = _mm_set1_ps(NO_DATA_VALUE);
+#endif
+		for (int r = 0; r < m_Pixels.pixY; ++r)
 		{
-			unsigned inv_r = m_Pixels.pixY - r - 1;
-			for (unsigned int c = 0; c < (unsigned)m_Pixels.pixX; c++)
+			const float *src = m_GDAL.elevationdata + (size_t)r * width;
+			float *dst = heights + (size_t)(m_Pixels.pixY - r - 1) * width;
+			int c = 0;
+#ifdef CDB_TILE_SSE2
+			for (; c + 4 <= width; c += 4)
 			{
-				//Re-enable this if data is suspect
-				//Should already be filtered in CDB creation however
-#if 0
-				float h = elevation[ibpos];
-				// Mark the value as nodata using the universal NO_DATA_VALUE marker.
-				if (!isValidValue(h, band))
-				{
-					h = NO_DATA_VALUE;
-				}
-#endif
-				field->setHeight(c, inv_r, m_GDAL.elevationdata[ibpos]);
-				++ibpos;
+				__m128 h = _mm_loadu_ps(src + c);
+				__m128 valid = Valid_Elevation_Mask(h, v_nodata);
+				_mm_storeu_ps(dst + c, _mm_or_ps(_mm_and_ps(valid, h), _mm_andnot_ps(valid, v_marker)));
 			}
+#endif
+			for (; c < width; ++c)
+				dst[c] = Valid_Elevation(src[c], nodata) ? src[c] : NO_DATA_VALUE;
 		}
 		return field.release();
 	}
@@ -1998,13 +3582,13 @@ std::string CDB_Tile::Model_FullFileName(std::string &AttrName, std::string &Bas
 {
 	std::stringstream modbuf;
 	modbuf << m_cdbRootDir
-		<< "\\Tiles"
-		<< "\\" << m_lat_str
-		<< "\\" << m_lon_str
-		<< "\\300_GSModelGeometry"
-		<< "\\" << m_lod_str
-		<< "\\" << m_uref_str
-		<< "\\" << m_lat_str << m_lon_str << "_D300_S001_T001_" << m_lod_str
+		<< "/Tiles"
+		<< "/" << m_lat_str
+		<< "/" << m_lon_str
+		<< "/300_GSModelGeometry"
+		<< "/" << m_lod_str
+		<< "/" << m_uref_str
+		<< "/" << m_lat_str << m_lon_str << "_D300_S001_T001_" << m_lod_str
 		<< "_" << m_uref_str << "_" << m_rref_str << "_"
 		<< AttrName.substr(0, 5) << "_" << AttrName.substr(5, 3) << "_"
 		<< BaseFileName << ".flt";
@@ -2066,11 +3650,11 @@ std::string CDB_Tile::GeoTypical_FullFileName(std::string &BaseFileName)
 
 	std::stringstream modbuf;
 	modbuf << m_cdbRootDir
-		<< "\\GTModel\\500_GTModelGeometry"
-		<< "\\" << Facc1
-		<< "\\" << Facc2
-		<< "\\" << Fcode
-		<< "\\D500_S001_T001_" << BaseFileName;
+		<< "/GTModel/500_GTModelGeometry"
+		<< "/" << Facc1
+		<< "/" << Facc2
+		<< "/" << Fcode
+		<< "/D500_S001_T001_" << BaseFileName;
 
 	return modbuf.str();
 }
@@ -2089,12 +3673,12 @@ std::string CDB_Tile::Model_TextureDir(void)
 {
 	std::stringstream modbuf;
 	modbuf << m_cdbRootDir
-		<< "\\Tiles"
-		<< "\\" << m_lat_str
-		<< "\\" << m_lon_str
-		<< "\\301_GSModelTexture"
-		<< "\\" << m_lod_str
-		<< "\\" << m_uref_str;
+		<< "/Tiles"
+		<< "/" << m_lat_str
+		<< "/" << m_lon_str
+		<< "/301_GSModelTexture"
+		<< "/" << m_lod_str
+		<< "/" << m_uref_str;
 	return modbuf.str();
 }
 
@@ -2105,12 +3689,12 @@ std::string CDB_Tile::Model_ZipDir(void)
 		return retstr;
 	std::stringstream modbuf;
 	modbuf << m_cdbRootDir
-		<< "\\Tiles"
-		<< "\\" << m_lat_str
-		<< "\\" << m_lon_str
-		<< "\\300_GSModelGeometry"
-		<< "\\" << m_lod_str
-		<< "\\" << m_uref_str;
+		<< "/Tiles"
+		<< "/" << m_lat_str
+		<< "/" << m_lon_str
+		<< "/300_GSModelGeometry"
+		<< "/" << m_lod_str
+		<< "/" << m_uref_str;
 	return modbuf.str();
 }
 
@@ -1,6 +1,14 @@
 #pragma once
+#ifdef _WIN32
 #ifdef CDB_TILELIB_EXPORTS
 #define CDBTILELIBRARYAPI __declspec(dllexport)
 #else
 #define CDBTILELIBRARYAPI __declspec(dllimport)
 #endif
+#else
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+#define CDBTILELIBRARYAPI __attribute__ ((visibility("default")))
+#else
+#define CDBTILELIBRARYAPI
+#endif
+#endif
@@ -0,0 +1,1124 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+// Created for General Incorporation of Common Database (CDB) support within osgEarth
+
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This file is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// cdb_bench
+//
+// Generates a small synthetic CDB and times the CDB_TileLib operations the
+// drivers depend on. The results are written as JSON so runs can be compared
+// from commit to commit. The DXT1 imagery is decoded again and its largest
+// and RMS channel error against the uncompressed tile reported.
+//
+// cdb_bench [--root dir] [--no-generate] [--geocells n] [--max-lod n]
+//           [--features n] [--iterations n] [--cache-formats list]
+//           [--label text] [--json file]
+//
+
+#include <CDB_TileLib/CDB_Tile>
+#include <CDB_TileLib/CDB_Cache_Store>
+#include <CDB_TileLib/CDB_DXT>
+#include <osg/Timer>
+#include <osg/Image>
+#include <osg/Shape>
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+#include <gdal_priv.h>
+#include <ogrsf_frmts.h>
+#include <ogr_spatialref.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <math.h>
+#include <stdlib.h>
+
+#define BENCH_TILE_SIZE 1024
+#define BENCH_DATASET "_S001_T001_"
+
+struct BenchSeries
+{
+	std::string			Name;
+	std::vector<double>	Samples_ms;
+	int					Failures;
+	BenchSeries(const std::string &name) : Name(name), Failures(0)
+	{
+	}
+};
+
+struct BenchCacheResult
+{
+	std::string	Format;
+	std::string	Store;
+	std::string	Layer;
+	bool		Built;
+	double		Build_ms;
+	GIntBig		Bytes;
+	BenchSeries	Read;
+	BenchCacheResult(const std::string &format, const std::string &store, const std::string &layer) :
+		Format(format), Store(store), Layer(layer), Built(false), Build_ms(0.0), Bytes(0), Read("read")
+	{
+	}
+};
+
+//Every key covering the high latitude geocell from lod 0 to the finest lod,
+//served as the default profile (Build_Earth_Tile) or the zone profile (Load_Tile)
+struct BenchCoverage
+{
+	std::string	Layer;
+	std::string	Profile;
+	int			Keys;
+	int			Failures;
+	double		Total_ms;
+	BenchCoverage(const std::string &layer, const std::string &profile) :
+		Layer(layer), Profile(profile), Keys(0), Failures(0), Total_ms(0.0)
+	{
+	}
+};
+
+//Level 0 of the DXT1 tiles decoded and compared with the uncompressed tiles
+struct BenchDxtError
+{
+	int		Tiles;
+	int		Max_Error;
+	double	Sum_Squares;
+	double	Samples;
+	BenchDxtError() : Tiles(0), Max_Error(0), Sum_Squares(0.0), Samples(0.0)
+	{
+	}
+};
+
+struct BenchOptions
+{
+	std::string	Root;
+	bool		Generate;
+	int			Geocells;
+	int			MaxLod;
+	int			Features;
+	int			Iterations;
+	std::string	CacheFormats;
+	std::string	Label;
+	std::string	JsonFile;
+	BenchOptions() : Root("cdb_bench_data"), Generate(true), Geocells(2), MaxLod(1), Features(500), Iterations(5),
+					 CacheFormats("NONE,DEFLATE,LZW,ZSTD"), Label("")
+	{
+	}
+};
+
+//The synthetic CDB covers Geocells one degree geocells eastward from N32 W118
+//and a single two degree wide geocell at N50 E000 for the high latitude paths.
+static const double s_BaseLat = 32.0;
+static const double s_BaseLon = -118.0;
+static const double s_HighLat = 50.0;
+static const double s_HighLon = 0.0;
+
+static double elapsed_ms(osg::Timer_t start)
+{
+	return osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+}
+
+static std::string json_escape(const std::string &in)
+{
+	std::string out;
+	for (size_t i = 0; i < in.size(); ++i)
+	{
+		char c = in[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if ((unsigned char)c < 0x20)
+			out += ' ';
+		else
+			out += c;
+	}
+	return out;
+}
+
+static double percentile(std::vector<double> &sorted, double pct)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t idx = (size_t)ceil((pct / 100.0) * (double)sorted.size());
+	if (idx > 0)
+		--idx;
+	if (idx >= sorted.size())
+		idx = sorted.size() - 1;
+	return sorted[idx];
+}
+
+static void write_series(std::ostream &out, BenchSeries &series, const std::string &indent)
+{
+	std::vector<double> sorted = series.Samples_ms;
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (size_t i = 0; i < sorted.size(); ++i)
+		total += sorted[i];
+	double mean = sorted.empty() ? 0.0 : total / (double)sorted.size();
+
+	out << indent << "{\"name\": \"" << json_escape(series.Name) << "\", \"count\": " << sorted.size()
+		<< ", \"failures\": " << series.Failures
+		<< ", \"mean_ms\": " << mean
+		<< ", \"min_ms\": " << (sorted.empty() ? 0.0 : sorted.front())
+		<< ", \"p50_ms\": " << percentile(sorted, 50.0)
+		<< ", \"p95_ms\": " << percentile(sorted, 95.0)
+		<< ", \"max_ms\": " << (sorted.empty() ? 0.0 : sorted.back())
+		<< ", \"total_ms\": " << total << "}";
+}
+
+//Small deterministic generator so every run produces the same dataset
+static unsigned int bench_rand(unsigned int &state)
+{
+	state = state * 1664525u + 1013904223u;
+	return state >> 8;
+}
+
+static std::string wgs84_wkt(void)
+{
+	OGRSpatialReference srs;
+	srs.SetWellKnownGeogCS("WGS84");
+	char *wkt = NULL;
+	srs.exportToWkt(&wkt);
+	std::string result = wkt ? wkt : "";
+	CPLFree(wkt);
+	return result;
+}
+
+static void set_tile_georef(GDALDataset *ds, CDB_Tile_Extent &extent)
+{
+	double transform[6];
+	transform[0] = extent.West;
+	transform[1] = (extent.East - extent.West) / (double)BENCH_TILE_SIZE;
+	transform[2] = 0.0;
+	transform[3] = extent.North;
+	transform[4] = 0.0;
+	transform[5] = -(extent.North - extent.South) / (double)BENCH_TILE_SIZE;
+	ds->SetGeoTransform(transform);
+	ds->SetProjection(wgs84_wkt().c_str());
+}
+
+static GDALDriver * find_jp2_writer(void)
+{
+	const char *names[] = { "JP2OpenJPEG", "JP2ECW", "JP2KAK", "JPEG2000", NULL };
+	for (int i = 0; names[i]; ++i)
+	{
+		GDALDriver *driver = GetGDALDriverManager()->GetDriverByName(names[i]);
+		if (driver && driver->GetMetadataItem(GDAL_DCAP_CREATECOPY))
+			return driver;
+	}
+	return NULL;
+}
+
+static bool write_imagery(const std::string &filename, CDB_Tile_Extent &extent, GDALDriver *jp2Driver, unsigned int seed)
+{
+	GDALDriver *memDriver = GetGDALDriverManager()->GetDriverByName("MEM");
+	if (!memDriver)
+		return false;
+	GDALDataset *mem = memDriver->Create("", BENCH_TILE_SIZE, BENCH_TILE_SIZE, 3, GDT_Byte, NULL);
+	if (!mem)
+		return false;
+	set_tile_georef(mem, extent);
+
+	//Smooth colour ramps with some noise compress like real imagery rather than like a flat fill
+	std::vector<unsigned char> band(BENCH_TILE_SIZE * BENCH_TILE_SIZE);
+	unsigned int state = seed;
+	for (int b = 1; b <= 3; ++b)
+	{
+		for (int y = 0; y < BENCH_TILE_SIZE; ++y)
+		{
+			for (int x = 0; x < BENCH_TILE_SIZE; ++x)
+			{
+				double v = 96.0 + 48.0 * sin((x + 37 * b) / 61.0) + 40.0 * cos((y + 13 * b) / 47.0);
+				v += (double)(bench_rand(state) % 24);
+				band[y * BENCH_TILE_SIZE + x] = (unsigned char)std::max(0.0, std::min(255.0, v));
+			}
+		}
+		mem->GetRasterBand(b)->RasterIO(GF_Write, 0, 0, BENCH_TILE_SIZE, BENCH_TILE_SIZE, &band[0],
+										BENCH_TILE_SIZE, BENCH_TILE_SIZE, GDT_Byte, 0, 0);
+	}
+
+	osgDB::makeDirectoryForFile(filename);
+	GDALDataset *out = jp2Driver->CreateCopy(filename.c_str(), mem, FALSE, NULL, NULL, NULL);
+	GDALClose(mem);
+	if (!out)
+		return false;
+	GDALClose(out);
+	return true;
+}
+
+static bool write_elevation(const std::string &filename, CDB_Tile_Extent &extent, unsigned int seed)
+{
+	GDALDriver *gtiff = GetGDALDriverManager()->GetDriverByName("GTiff");
+	if (!gtiff)
+		return false;
+	osgDB::makeDirectoryForFile(filename);
+	GDALDataset *ds = gtiff->Create(filename.c_str(), BENCH_TILE_SIZE, BENCH_TILE_SIZE, 1, GDT_Float32, NULL);
+	if (!ds)
+		return false;
+	set_tile_georef(ds, extent);
+
+	std::vector<float> heights(BENCH_TILE_SIZE * BENCH_TILE_SIZE);
+	unsigned int state = seed;
+	double dx = (extent.East - extent.West) / (double)BENCH_TILE_SIZE;
+	double dy = (extent.North - extent.South) / (double)BENCH_TILE_SIZE;
+	for (int y = 0; y < BENCH_TILE_SIZE; ++y)
+	{
+		double lat = extent.North - (y + 0.5) * dy;
+		for (int x = 0; x < BENCH_TILE_SIZE; ++x)
+		{
+			//Hills defined in geographic space so neighbouring tiles and lods agree
+			double lon = extent.West + (x + 0.5) * dx;
+			double h = 400.0 + 250.0 * sin(lon * 9.0) * cos(lat * 7.0) + 60.0 * sin(lon * 53.0 + lat * 31.0);
+			h += (double)(bench_rand(state) % 100) * 0.05;
+			heights[y * BENCH_TILE_SIZE + x] = (float)h;
+		}
+	}
+	ds->GetRasterBand(1)->RasterIO(GF_Write, 0, 0, BENCH_TILE_SIZE, BENCH_TILE_SIZE, &heights[0],
+								   BENCH_TILE_SIZE, BENCH_TILE_SIZE, GDT_Float32, 0, 0);
+	GDALClose(ds);
+	return true;
+}
+
+static std::string replace_once(const std::string &in, const std::string &from, const std::string &to)
+{
+	std::string out = in;
+	size_t pos = out.find(from);
+	if (pos != std::string::npos)
+		out.replace(pos, from.size(), to);
+	return out;
+}
+
+static GDALDataset * create_vector(const std::string &filename)
+{
+	GDALDriver *shp = GetGDALDriverManager()->GetDriverByName("ESRI Shapefile");
+	if (!shp)
+		return NULL;
+	osgDB::makeDirectoryForFile(filename);
+	return shp->Create(filename.c_str(), 0, 0, 0, GDT_Unknown, NULL);
+}
+
+static void add_field(OGRLayer *layer, const char *name, OGRFieldType type, int width = 0)
+{
+	OGRFieldDefn field(name, type);
+	if (width > 0)
+		field.SetWidth(width);
+	layer->CreateField(&field);
+}
+
+//Writes the point instance file and the class attribute file of a model feature set
+static bool write_model_features(const std::string &pointName, const std::string &className, CDB_Tile_Extent &extent,
+								 int count, int classes, const std::string &facc, unsigned int seed)
+{
+	OGRSpatialReference srs;
+	srs.SetWellKnownGeogCS("WGS84");
+
+	GDALDataset *pds = create_vector(pointName);
+	if (!pds)
+		return false;
+	OGRLayer *points = pds->CreateLayer(osgDB::getNameLessExtension(osgDB::getSimpleFileName(pointName)).c_str(), &srs, wkbPoint, NULL);
+	if (!points)
+	{
+		GDALClose(pds);
+		return false;
+	}
+	add_field(points, "CNAM", OFTString, 32);
+	add_field(points, "AO1", OFTReal);
+	add_field(points, "SCALX", OFTReal);
+	add_field(points, "SCALY", OFTReal);
+	add_field(points, "SCALZ", OFTReal);
+
+	unsigned int state = seed;
+	for (int i = 0; i < count; ++i)
+	{
+		OGRFeature *f = OGRFeature::CreateFeature(points->GetLayerDefn());
+		std::stringstream cnam;
+		cnam << "CLS" << (i % classes);
+		f->SetField("CNAM", cnam.str().c_str());
+		f->SetField("AO1", (double)(bench_rand(state) % 360));
+		f->SetField("SCALX", 1.0);
+		f->SetField("SCALY", 1.0);
+		f->SetField("SCALZ", 1.0);
+		double lon = extent.West + (extent.East - extent.West) * (double)(bench_rand(state) % 10000) / 10000.0;
+		double lat = extent.South + (extent.North - extent.South) * (double)(bench_rand(state) % 10000) / 10000.0;
+		OGRPoint pt(lon, lat);
+		f->SetGeometry(&pt);
+		points->CreateFeature(f);
+		OGRFeature::DestroyFeature(f);
+	}
+	GDALClose(pds);
+
+	GDALDataset *cds = create_vector(className);
+	if (!cds)
+		return false;
+	OGRLayer *cls = cds->CreateLayer(osgDB::getNameLessExtension(osgDB::getSimpleFileName(className)).c_str(), NULL, wkbNone, NULL);
+	if (!cls)
+	{
+		GDALClose(cds);
+		return false;
+	}
+	add_field(cls, "CNAM", OFTString, 32);
+	add_field(cls, "MODL", OFTString, 32);
+	add_field(cls, "FACC", OFTString, 5);
+	add_field(cls, "FSC", OFTInteger);
+	add_field(cls, "HGT", OFTReal);
+	add_field(cls, "BSR", OFTReal);
+	add_field(cls, "BBW", OFTReal);
+	add_field(cls, "BBH", OFTReal);
+	for (int c = 0; c < classes; ++c)
+	{
+		OGRFeature *f = OGRFeature::CreateFeature(cls->GetLayerDefn());
+		std::stringstream cnam, modl;
+		cnam << "CLS" << c;
+		modl << "model" << c;
+		f->SetField("CNAM", cnam.str().c_str());
+		f->SetField("MODL", modl.str().c_str());
+		f->SetField("FACC", facc.c_str());
+		f->SetField("FSC", 0);
+		f->SetField("HGT", 10.0);
+		f->SetField("BSR", 8.0);
+		f->SetField("BBW", 10.0);
+		f->SetField("BBH", 10.0);
+		cls->CreateFeature(f);
+		OGRFeature::DestroyFeature(f);
+	}
+	GDALClose(cds);
+	return true;
+}
+
+//The geospecific model geometry archive holds one .flt per model class
+static bool write_model_archive(const std::string &archiveName, const std::string &entryPrefix, int classes, const std::string &facc)
+{
+	osgDB::makeDirectoryForFile(archiveName);
+	void *zip = CPLCreateZip(archiveName.c_str(), NULL);
+	if (!zip)
+		return false;
+	static const char s_flt[] = "synthetic OpenFlight placeholder";
+	for (int c = 0; c < classes; ++c)
+	{
+		std::stringstream entry;
+		entry << entryPrefix << "_" << facc << "_000_model" << c << ".flt";
+		if (CPLCreateFileInZip(zip, entry.str().c_str(), NULL) != CE_None)
+			break;
+		CPLWriteFileInZip(zip, s_flt, (int)sizeof(s_flt));
+		CPLCloseFileInZip(zip);
+	}
+	CPLCloseZip(zip);
+	return true;
+}
+
+static bool write_typical_models(const std::string &root, int classes)
+{
+	static const char s_flt[] = "synthetic OpenFlight placeholder";
+	for (int c = 0; c < classes; ++c)
+	{
+		std::stringstream name;
+		name << root << "/GTModel/500_GTModelGeometry/E_Vegetation/C_Woodland/030_Trees/D500_S001_T001_EC030_000_model" << c << ".flt";
+		osgDB::makeDirectoryForFile(name.str());
+		std::ofstream out(name.str().c_str(), std::ios::binary);
+		if (!out)
+			return false;
+		out.write(s_flt, sizeof(s_flt));
+	}
+	return true;
+}
+
+static void geocell_extent(int cell, bool highLat, CDB_Tile_Extent &extent)
+{
+	if (highLat)
+	{
+		extent.South = s_HighLat;
+		extent.West = s_HighLon;
+		extent.East = s_HighLon + CDB_Tile::Get_Lon_Step(s_HighLat);
+	}
+	else
+	{
+		extent.South = s_BaseLat;
+		extent.West = s_BaseLon + (double)cell;
+		extent.East = extent.West + 1.0;
+	}
+	extent.North = extent.South + 1.0;
+}
+
+//All of the CDB tile extents of a geocell at one lod
+static void lod_extents(CDB_Tile_Extent &cell, int lod, std::vector<CDB_Tile_Extent> &extents)
+{
+	int n = 1 << lod;
+	double dlon = (cell.East - cell.West) / (double)n;
+	double dlat = (cell.North - cell.South) / (double)n;
+	for (int y = 0; y < n; ++y)
+	{
+		for (int x = 0; x < n; ++x)
+		{
+			CDB_Tile_Extent e;
+			e.West = cell.West + x * dlon;
+			e.East = e.West + dlon;
+			e.South = cell.South + y * dlat;
+			e.North = e.South + dlat;
+			extents.push_back(e);
+		}
+	}
+}
+
+static bool generate_cdb(BenchOptions &opts, GDALDriver *jp2Driver, const std::string &cacheDir)
+{
+	const int classes = 8;
+	int written = 0;
+	for (int cell = 0; cell <= opts.Geocells; ++cell)
+	{
+		bool highLat = (cell == opts.Geocells);
+		CDB_Tile_Extent cellExtent;
+		geocell_extent(cell, highLat, cellExtent);
+		for (int lod = 0; lod <= opts.MaxLod; ++lod)
+		{
+			std::vector<CDB_Tile_Extent> extents;
+			lod_extents(cellExtent, lod, extents);
+			for (size_t i = 0; i < extents.size(); ++i)
+			{
+				unsigned int seed = (unsigned int)(cell * 7919 + lod * 104729 + (int)i * 31);
+
+				//Let CDB_Tile name the files so the layout always matches the reader
+				CDB_Tile imagery(opts.Root, cacheDir, Imagery, BENCH_DATASET, &extents[i]);
+				if (!write_imagery(imagery.FileName(), extents[i], jp2Driver, seed))
+				{
+					std::cerr << "Unable to write " << imagery.FileName() << std::endl;
+					return false;
+				}
+				CDB_Tile elevation(opts.Root, cacheDir, Elevation, BENCH_DATASET, &extents[i]);
+				if (!write_elevation(elevation.FileName(), extents[i], seed))
+				{
+					std::cerr << "Unable to write " << elevation.FileName() << std::endl;
+					return false;
+				}
+				written += 2;
+
+				if ((lod != opts.MaxLod) || highLat)
+					continue;
+
+				//Geospecific and geotypical models on the finest lod
+				CDB_Tile gs(opts.Root, cacheDir, GeoSpecificModel, BENCH_DATASET, &extents[i]);
+				std::string gsName = gs.FileName();
+				std::string gsClass = osgDB::getNameLessExtension(replace_once(gsName, "_D100_S001_T001_", "_D100_S001_T002_")) + ".dbf";
+				if (!write_model_features(gsName, gsClass, extents[i], opts.Features, classes, "AL015", seed))
+				{
+					std::cerr << "Unable to write " << gsName << std::endl;
+					return false;
+				}
+				std::string simple = osgDB::getNameLessExtension(osgDB::getSimpleFileName(gsName));
+				size_t dpos = simple.find("_D100_S001_T001_");
+				std::string entryPrefix = simple.substr(0, dpos) + "_D300_S001_T001_" + simple.substr(dpos + 16);
+				std::string archive = replace_once(replace_once(gsName, "/100_GSFeature/", "/300_GSModelGeometry/"), "_D100_S001_T001_", "_D300_S001_T001_");
+				archive = osgDB::getNameLessExtension(archive) + ".zip";
+				if (!write_model_archive(archive, entryPrefix, classes, "AL015"))
+				{
+					std::cerr << "Unable to write " << archive << std::endl;
+					return false;
+				}
+
+				std::string gtName = replace_once(replace_once(gsName, "/100_GSFeature/", "/101_GTFeature/"), "_D100_S001_T001_", "_D101_S001_T001_");
+				std::string gtClass = osgDB::getNameLessExtension(replace_once(gtName, "_D101_S001_T001_", "_D101_S001_T002_")) + ".dbf";
+				if (!write_model_features(gtName, gtClass, extents[i], opts.Features, classes, "EC030", seed + 1))
+				{
+					std::cerr << "Unable to write " << gtName << std::endl;
+					return false;
+				}
+				written += 2;
+			}
+		}
+	}
+	if (!write_typical_models(opts.Root, classes))
+		return false;
+	std::cerr << "Generated " << written << " CDB tiles in " << opts.Root << std::endl;
+	return true;
+}
+
+static void bench_constructor(BenchOptions &opts, const std::string &cacheDir, std::vector<CDB_Tile_Extent> &extents, CDB_Tile_Type type, BenchSeries &series)
+{
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		for (size_t i = 0; i < extents.size(); ++i)
+		{
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			CDB_Tile *tile = new CDB_Tile(opts.Root, cacheDir, type, BENCH_DATASET, &extents[i]);
+			delete tile;
+			series.Samples_ms.push_back(elapsed_ms(start));
+		}
+	}
+}
+
+static void bench_load(BenchOptions &opts, const std::string &cacheDir, std::vector<CDB_Tile_Extent> &extents, CDB_Tile_Type type,
+					   BenchSeries &load, BenchSeries &convert)
+{
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		for (size_t i = 0; i < extents.size(); ++i)
+		{
+			CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &extents[i]);
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			bool loaded = tile.Load_Tile();
+			if (!loaded)
+			{
+				++load.Failures;
+				continue;
+			}
+			load.Samples_ms.push_back(elapsed_ms(start));
+
+			start = osg::Timer::instance()->tick();
+			if (type == Imagery)
+			{
+				osg::ref_ptr<osg::Image> image = tile.Image_From_Tile();
+				if (!image.valid())
+					++convert.Failures;
+			}
+			else
+			{
+				osg::ref_ptr<osg::HeightField> field = tile.HeightField_From_Tile();
+				if (!field.valid())
+					++convert.Failures;
+			}
+			convert.Samples_ms.push_back(elapsed_ms(start));
+		}
+	}
+}
+
+static void bench_dxt(BenchOptions &opts, const std::string &cacheDir, std::vector<CDB_Tile_Extent> &extents, BenchSeries &series,
+					  BenchDxtError &error)
+{
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		for (size_t i = 0; i < extents.size(); ++i)
+		{
+			CDB_Tile tile(opts.Root, cacheDir, Imagery, BENCH_DATASET, &extents[i]);
+			if (!tile.Load_Tile())
+			{
+				++series.Failures;
+				continue;
+			}
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			osg::ref_ptr<osg::Image> compressed = tile.Compressed_Image_From_Tile(true);
+			double compress_ms = elapsed_ms(start);
+			if (!compressed.valid() || !compressed->isCompressed())
+			{
+				++series.Failures;
+				continue;
+			}
+			series.Samples_ms.push_back(compress_ms);
+			if (it > 0)
+				continue;
+
+			//Both images are bottom row first, the blocks run row by row from the bottom
+			osg::ref_ptr<osg::Image> reference = tile.Image_From_Tile();
+			if (!reference.valid())
+				continue;
+			int width = reference->s();
+			int height = reference->t();
+			const unsigned char *block = compressed->data();
+			unsigned char rgba[64];
+			for (int by = 0; by < height; by += 4)
+			{
+				for (int bx = 0; bx < width; bx += 4)
+				{
+					CDB_DXT::Decode_Block(block, rgba);
+					block += 8;
+					for (int p = 0; p < 16; ++p)
+					{
+						const unsigned char *ref = reference->data(bx + (p % 4), by + (p / 4));
+						for (int c = 0; c < 3; ++c)
+						{
+							int diff = abs((int)rgba[p * 4 + c] - (int)ref[c]);
+							error.Max_Error = std::max(error.Max_Error, diff);
+							error.Sum_Squares += (double)(diff * diff);
+						}
+						error.Samples += 3.0;
+					}
+				}
+			}
+			++error.Tiles;
+		}
+	}
+}
+
+static void bench_earth_tile(BenchOptions &opts, const std::string &cacheDir, CDB_Tile_Type type, BenchSeries &series)
+{
+	//osgEarth profile keys over the two degree wide high latitude geocell
+	std::vector<CDB_Tile_Extent> keys;
+	for (int lod = 0; lod <= opts.MaxLod; ++lod)
+	{
+		double size = 1.0 / (double)(1 << lod);
+		CDB_Tile_Extent key;
+		key.West = s_HighLon;
+		key.East = key.West + size;
+		key.South = s_HighLat;
+		key.North = key.South + size;
+		keys.push_back(key);
+	}
+
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &keys[i]);
+			if (!tile.Build_Earth_Tile())
+			{
+				++series.Failures;
+				continue;
+			}
+			series.Samples_ms.push_back(elapsed_ms(start));
+		}
+	}
+}
+
+static void bench_high_lat_coverage(BenchOptions &opts, const std::string &cacheDir, CDB_Tile_Type type, bool zone, BenchCoverage &result)
+{
+	CDB_Tile_Extent cell;
+	geocell_extent(0, true, cell);
+	std::vector<CDB_Tile_Extent> keys;
+	for (int lod = 0; lod <= opts.MaxLod; ++lod)
+	{
+		if (zone)
+		{
+			//Keys as wide as the CDB tiles
+			lod_extents(cell, lod, keys);
+		}
+		else
+		{
+			//Square keys, several to each CDB tile
+			double size = 1.0 / (double)(1 << lod);
+			int nx = (int)round((cell.East - cell.West) / size);
+			int ny = 1 << lod;
+			for (int y = 0; y < ny; ++y)
+			{
+				for (int x = 0; x < nx; ++x)
+				{
+					CDB_Tile_Extent key;
+					key.West = cell.West + x * size;
+					key.East = key.West + size;
+					key.South = cell.South + y * size;
+					key.North = key.South + size;
+					keys.push_back(key);
+				}
+			}
+		}
+	}
+
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		//Start each pass without the decoded tiles of the last one
+		CDB_Tile::Set_Decoded_Cache_Size(0);
+		CDB_Tile::Set_Decoded_Cache_Size(64);
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &keys[i]);
+			bool built = zone ? (tile.Tile_Exists() && tile.Load_Tile()) : tile.Build_Earth_Tile();
+			if (!built)
+			{
+				++result.Failures;
+				continue;
+			}
+			if (type == Imagery)
+			{
+				osg::ref_ptr<osg::Image> image = tile.Image_From_Tile();
+			}
+			else
+			{
+				osg::ref_ptr<osg::HeightField> field = tile.HeightField_From_Tile();
+			}
+		}
+		result.Total_ms += elapsed_ms(start);
+		result.Keys += (int)keys.size();
+	}
+}
+
+static CDB_Tile_Extent cache_tile_extent(void)
+{
+	//The lod -1 cache tile is two degrees on a side
+	CDB_Tile_Extent extent;
+	extent.West = s_BaseLon;
+	extent.East = s_BaseLon + 2.0;
+	extent.South = s_BaseLat;
+	extent.North = s_BaseLat + 2.0;
+	return extent;
+}
+
+static void remove_cache_tile(CDB_Tile &tile)
+{
+	std::string name = tile.FileName();
+	if (!name.empty())
+		VSIUnlink(name.c_str());
+}
+
+static void bench_cache_tile(BenchOptions &opts, const std::string &cacheDir, CDB_Tile_Type type, BenchSeries &series)
+{
+	CDB_Tile_Extent extent = cache_tile_extent();
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &extent);
+		remove_cache_tile(tile);
+		CDB_Tile fresh(opts.Root, cacheDir, type, BENCH_DATASET, &extent);
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		if (!fresh.Build_Cache_Tile(true))
+		{
+			++series.Failures;
+			continue;
+		}
+		series.Samples_ms.push_back(elapsed_ms(start));
+		remove_cache_tile(fresh);
+	}
+}
+
+static void bench_features(BenchOptions &opts, const std::string &cacheDir, std::vector<CDB_Tile_Extent> &extents, CDB_Tile_Type type,
+						   BenchSeries &series, GIntBig &featureCount)
+{
+	for (int it = 0; it < opts.Iterations; ++it)
+	{
+		for (size_t i = 0; i < extents.size(); ++i)
+		{
+			osg::Timer_t start = osg::Timer::instance()->tick();
+			CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &extents[i]);
+			int sels = tile.Model_Sel_Count();
+			bool any = false;
+			for (int sel = 0; sel < sels; ++sel)
+			{
+				if (!tile.Tile_Exists(sel) || !tile.Init_Model_Tile(sel))
+					continue;
+				any = true;
+				std::string keyName, fullName, archiveName;
+				bool inArchive = false;
+				OGRFeature *f;
+				while ((f = tile.Next_Valid_Feature(sel, false, keyName, fullName, archiveName, inArchive)) != NULL)
+				{
+					if (it == 0)
+						++featureCount;
+					OGRFeature::DestroyFeature(f);
+				}
+			}
+			if (!any)
+			{
+				++series.Failures;
+				continue;
+			}
+			series.Samples_ms.push_back(elapsed_ms(start));
+		}
+	}
+}
+
+static GIntBig directory_bytes(const std::string &dir)
+{
+	GIntBig total = 0;
+	osgDB::DirectoryContents contents = osgDB::getDirectoryContents(dir);
+	for (size_t i = 0; i < contents.size(); ++i)
+	{
+		if (contents[i] == "." || contents[i] == "..")
+			continue;
+		std::string path = dir + "/" + contents[i];
+		VSIStatBufL stat;
+		if (VSIStatL(path.c_str(), &stat) == 0)
+		{
+			if (VSI_ISDIR(stat.st_mode))
+				total += directory_bytes(path);
+			else
+				total += (GIntBig)stat.st_size;
+		}
+	}
+	return total;
+}
+
+static void clear_directory(const std::string &dir)
+{
+	osgDB::DirectoryContents contents = osgDB::getDirectoryContents(dir);
+	for (size_t i = 0; i < contents.size(); ++i)
+	{
+		std::string path = dir + "/" + contents[i];
+		if (osgDB::fileType(path) == osgDB::REGULAR_FILE)
+			VSIUnlink(path.c_str());
+	}
+}
+
+static bool gtiff_supports(const std::string &compression)
+{
+	if (compression == "NONE")
+		return true;
+	GDALDriver *gtiff = GetGDALDriverManager()->GetDriverByName("GTiff");
+	const char *options = gtiff ? gtiff->GetMetadataItem(GDAL_DMD_CREATIONOPTIONLIST) : NULL;
+	return options && (std::string(options).find(compression) != std::string::npos);
+}
+
+//Writes the lod -1 cache tiles with each format and reads them back
+static void bench_cache_formats(BenchOptions &opts, std::vector<BenchCacheResult> &results)
+{
+	std::vector<std::string> formats;
+	std::stringstream list(opts.CacheFormats);
+	std::string item;
+	while (std::getline(list, item, ','))
+	{
+		if (!item.empty())
+			formats.push_back(item);
+	}
+
+	CDB_Tile_Extent extent = cache_tile_extent();
+	for (size_t fi = 0; fi < formats.size(); ++fi)
+	{
+		for (int packed = 0; packed < 2; ++packed)
+		{
+			std::string compression = formats[fi];
+			if (!packed && !gtiff_supports(compression))
+			{
+				std::cerr << "GTiff does not support " << compression << " compression, skipped" << std::endl;
+				continue;
+			}
+			if (packed && (compression != "NONE") && (compression != "DEFLATE"))
+				continue;
+
+			CDB_Cache_Format format;
+			format.Compression = compression;
+			if (compression != "NONE")
+			{
+				format.Tiled = true;
+				format.Elevation_GTiff = true;
+			}
+
+			std::string store = packed ? "packed" : "files";
+			std::string cacheDir = opts.Root + "/bench_cache/" + store + "_" + compression;
+			osgDB::makeDirectory(cacheDir + "/004_Imagery");
+			osgDB::makeDirectory(cacheDir + "/001_Elevation");
+			//Start from an empty cache so the footprint is that of one tile per layer
+			clear_directory(cacheDir + "/004_Imagery");
+			clear_directory(cacheDir + "/001_Elevation");
+			if (packed)
+				CDB_Cache_Store::Use_Packed_Cache(cacheDir);
+
+			for (int layer = 0; layer < 2; ++layer)
+			{
+				CDB_Tile_Type type = layer ? Elevation : Imagery;
+				BenchCacheResult result(compression, store, layer ? "elevation" : "imagery");
+				std::string layerDir = cacheDir + (layer ? "/001_Elevation" : "/004_Imagery");
+
+				{
+					CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &extent);
+					tile.Set_Cache_Format(format);
+					osg::Timer_t start = osg::Timer::instance()->tick();
+					result.Built = tile.Build_Cache_Tile(true);
+					result.Build_ms = elapsed_ms(start);
+				}
+				result.Bytes = directory_bytes(layerDir);
+
+				for (int it = 0; result.Built && (it < opts.Iterations); ++it)
+				{
+					osg::Timer_t start = osg::Timer::instance()->tick();
+					CDB_Tile tile(opts.Root, cacheDir, type, BENCH_DATASET, &extent);
+					tile.Set_Cache_Format(format);
+					if (!tile.Tile_Exists() || !tile.Load_Tile())
+					{
+						++result.Read.Failures;
+						continue;
+					}
+					result.Read.Samples_ms.push_back(elapsed_ms(start));
+				}
+				results.push_back(result);
+			}
+		}
+	}
+}
+
+static bool parse_args(int argc, char **argv, BenchOptions &opts)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+		if (arg == "--root" && hasValue)
+			opts.Root = argv[++i];
+		else if (arg == "--no-generate")
+			opts.Generate = false;
+		else if (arg == "--geocells" && hasValue)
+			opts.Geocells = std::max(1, atoi(argv[++i]));
+		else if (arg == "--max-lod" && hasValue)
+			opts.MaxLod = std::max(0, std::min(4, atoi(argv[++i])));
+		else if (arg == "--features" && hasValue)
+			opts.Features = std::max(1, atoi(argv[++i]));
+		else if (arg == "--iterations" && hasValue)
+			opts.Iterations = std::max(1, atoi(argv[++i]));
+		else if (arg == "--cache-formats" && hasValue)
+			opts.CacheFormats = argv[++i];
+		else if (arg == "--label" && hasValue)
+			opts.Label = argv[++i];
+		else if (arg == "--json" && hasValue)
+			opts.JsonFile = argv[++i];
+		else
+		{
+			std::cerr << "usage: cdb_bench [--root dir] [--no-generate] [--geocells n] [--max-lod n] [--features n]" << std::endl
+					  << "                 [--iterations n] [--cache-formats NONE,DEFLATE,...] [--label text] [--json file]" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opts;
+	if (!parse_args(argc, argv, opts))
+		return 1;
+
+	GDALAllRegister();
+	std::string errorMsg;
+	if (!CDB_Tile::Initialize_Tile_Drivers(errorMsg))
+	{
+		std::cerr << "cdb_bench: " << errorMsg << std::endl;
+		return 1;
+	}
+	GDALDriver *jp2Driver = find_jp2_writer();
+	if (opts.Generate && !jp2Driver)
+	{
+		std::cerr << "cdb_bench: no GDAL JP2 driver able to write the synthetic imagery" << std::endl;
+		return 1;
+	}
+
+	std::string cacheDir = opts.Root + "/osgEarth/CDB_Cache";
+	osgDB::makeDirectory(cacheDir + "/004_Imagery");
+	osgDB::makeDirectory(cacheDir + "/001_Elevation");
+
+	double generate_ms = 0.0;
+	if (opts.Generate)
+	{
+		osg::Timer_t start = osg::Timer::instance()->tick();
+		if (!generate_cdb(opts, jp2Driver, cacheDir))
+			return 1;
+		generate_ms = elapsed_ms(start);
+	}
+
+	//The tiles of the low latitude geocells by lod
+	std::vector<CDB_Tile_Extent> allExtents;
+	std::vector<CDB_Tile_Extent> finestExtents;
+	std::vector<CDB_Tile_Extent> missingExtents;
+	for (int cell = 0; cell < opts.Geocells; ++cell)
+	{
+		CDB_Tile_Extent cellExtent;
+		geocell_extent(cell, false, cellExtent);
+		for (int lod = 0; lod <= opts.MaxLod; ++lod)
+			lod_extents(cellExtent, lod, allExtents);
+		lod_extents(cellExtent, opts.MaxLod, finestExtents);
+	}
+	//Tiles below the finest lod do not exist and only cost the path probe
+	CDB_Tile_Extent firstCell;
+	geocell_extent(0, false, firstCell);
+	lod_extents(firstCell, opts.MaxLod + 1, missingExtents);
+
+	std::vector<BenchSeries> series;
+	series.push_back(BenchSeries("constructor_imagery"));
+	series.push_back(BenchSeries("constructor_elevation"));
+	series.push_back(BenchSeries("constructor_missing"));
+	series.push_back(BenchSeries("load_tile_imagery"));
+	series.push_back(BenchSeries("image_from_tile"));
+	series.push_back(BenchSeries("load_tile_elevation"));
+	series.push_back(BenchSeries("heightfield_from_tile"));
+	series.push_back(BenchSeries("build_earth_tile_imagery"));
+	series.push_back(BenchSeries("build_earth_tile_elevation"));
+	series.push_back(BenchSeries("build_cache_tile_imagery"));
+	series.push_back(BenchSeries("build_cache_tile_elevation"));
+	series.push_back(BenchSeries("features_geospecific"));
+	series.push_back(BenchSeries("features_geotypical"));
+	series.push_back(BenchSeries("dxt_compress_imagery"));
+
+	std::cerr << "Timing CDB_Tile operations" << std::endl;
+	bench_constructor(opts, cacheDir, allExtents, Imagery, series[0]);
+	bench_constructor(opts, cacheDir, allExtents, Elevation, series[1]);
+	bench_constructor(opts, cacheDir, missingExtents, Imagery, series[2]);
+	bench_load(opts, cacheDir, allExtents, Imagery, series[3], series[4]);
+	bench_load(opts, cacheDir, allExtents, Elevation, series[5], series[6]);
+	bench_earth_tile(opts, cacheDir, Imagery, series[7]);
+	bench_earth_tile(opts, cacheDir, Elevation, series[8]);
+	bench_cache_tile(opts, cacheDir, Imagery, series[9]);
+	bench_cache_tile(opts, cacheDir, Elevation, series[10]);
+	std::vector<BenchCoverage> coverage;
+	coverage.push_back(BenchCoverage("imagery", "default"));
+	coverage.push_back(BenchCoverage("imagery", "zone"));
+	coverage.push_back(BenchCoverage("elevation", "default"));
+	coverage.push_back(BenchCoverage("elevation", "zone"));
+	bench_high_lat_coverage(opts, cacheDir, Imagery, false, coverage[0]);
+	bench_high_lat_coverage(opts, cacheDir, Imagery, true, coverage[1]);
+	bench_high_lat_coverage(opts, cacheDir, Elevation, false, coverage[2]);
+	bench_high_lat_coverage(opts, cacheDir, Elevation, true, coverage[3]);
+	GIntBig gsFeatures = 0;
+	GIntBig gtFeatures = 0;
+	bench_features(opts, cacheDir, finestExtents, GeoSpecificModel, series[11], gsFeatures);
+	bench_features(opts, cacheDir, finestExtents, GeoTypicalModel, series[12], gtFeatures);
+	BenchDxtError dxtError;
+	bench_dxt(opts, cacheDir, finestExtents, series[13], dxtError);
+
+	std::cerr << "Comparing cache formats" << std::endl;
+	std::vector<BenchCacheResult> cacheResults;
+	bench_cache_formats(opts, cacheResults);
+
+	std::ofstream file;
+	if (!opts.JsonFile.empty())
+	{
+		file.open(opts.JsonFile.c_str());
+		if (!file)
+		{
+			std::cerr << "cdb_bench: unable to write " << opts.JsonFile << std::endl;
+			return 1;
+		}
+	}
+	std::ostream &out = opts.JsonFile.empty() ? std::cout : file;
+
+	CDB_Cancel_Stats stats = CDB_Tile::Get_Cancel_Stats();
+	out << "{" << std::endl;
+	out << "  \"benchmark\": \"cdb_bench\"," << std::endl;
+	out << "  \"label\": \"" << json_escape(opts.Label) << "\"," << std::endl;
+	out << "  \"gdal\": \"" << json_escape(GDALVersionInfo("RELEASE_NAME")) << "\"," << std::endl;
+	out << "  \"jp2_writer\": \"" << (jp2Driver ? json_escape(jp2Driver->GetDescription()) : "") << "\"," << std::endl;
+	out << "  \"dataset\": {\"root\": \"" << json_escape(opts.Root) << "\", \"geocells\": " << opts.Geocells
+		<< ", \"max_lod\": " << opts.MaxLod << ", \"features_per_tile\": " << opts.Features
+		<< ", \"iterations\": " << opts.Iterations << ", \"generate_ms\": " << generate_ms << "}," << std::endl;
+	out << "  \"features\": {\"geospecific\": " << gsFeatures << ", \"geotypical\": " << gtFeatures << "}," << std::endl;
+	out << "  \"dxt\": {\"tiles\": " << dxtError.Tiles << ", \"max_error\": " << dxtError.Max_Error
+		<< ", \"rms_error\": " << ((dxtError.Samples > 0.0) ? sqrt(dxtError.Sum_Squares / dxtError.Samples) : 0.0) << "}," << std::endl;
+	out << "  \"decodes\": {\"count\": " << stats.Decodes << ", \"secs\": " << stats.Decode_Secs << "}," << std::endl;
+	out << "  \"results\": [" << std::endl;
+	for (size_t i = 0; i < series.size(); ++i)
+	{
+		write_series(out, series[i], "    ");
+		out << ((i + 1 < series.size()) ? "," : "") << std::endl;
+	}
+	out << "  ]," << std::endl;
+	out << "  \"high_latitude\": [" << std::endl;
+	for (size_t i = 0; i < coverage.size(); ++i)
+	{
+		BenchCoverage &c = coverage[i];
+		double secs = c.Total_ms / 1000.0;
+		out << "    {\"layer\": \"" << c.Layer << "\", \"profile\": \"" << c.Profile << "\", \"keys\": " << c.Keys
+			<< ", \"failures\": " << c.Failures << ", \"total_ms\": " << c.Total_ms
+			<< ", \"keys_per_sec\": " << ((secs > 0.0) ? (double)c.Keys / secs : 0.0)
+			<< ", \"passes_per_sec\": " << ((secs > 0.0) ? (double)opts.Iterations / secs : 0.0) << "}"
+			<< ((i + 1 < coverage.size()) ? "," : "") << std::endl;
+	}
+	out << "  ]," << std::endl;
+	out << "  \"cache_formats\": [" << std::endl;
+	for (size_t i = 0; i < cacheResults.size(); ++i)
+	{
+		BenchCacheResult &r = cacheResults[i];
+		out << "    {\"compression\": \"" << json_escape(r.Format) << "\", \"store\": \"" << r.Store
+			<< "\", \"layer\": \"" << r.Layer << "\", \"built\": " << (r.Built ? "true" : "false")
+			<< ", \"build_ms\": " << r.Build_ms << ", \"bytes\": " << r.Bytes << ", \"read\": ";
+		write_series(out, r.Read, "");
+		out << "}" << ((i + 1 < cacheResults.size()) ? "," : "") << std::endl;
+	}
+	out << "  ]" << std::endl;
+	out << "}" << std::endl;
+	return 0;
+}
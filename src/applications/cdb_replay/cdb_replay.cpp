@@ -0,0 +1,591 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+// Created for General Incorporation of Common Database (CDB) support within osgEarth
+
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This file is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// cdb_replay
+//
+// Replays a tile key trace recorded by the CDB drivers (<trace_file> in the
+// layer options) against the cdb tile and feature sources, without a viewer.
+// Reports the throughput, latency percentiles and peak resident memory of
+// the run as JSON so caching and threading changes can be compared offline.
+//
+// cdb_replay --trace file (--earth file | --root dir) [--threads n]
+//            [--repeat n] [--realtime] [--set key=value]... [--stats]
+//            [--label text] [--json file]
+//
+
+#include <CDB_TileLib/CDB_Tile>
+#include <CDB_TileLib/CDB_Key_Trace>
+#include <CDB_TileLib/CDB_Stats>
+#include <osgEarth/Version>
+#include <osgEarth/Registry>
+#include <osgEarth/TileSource>
+#include <osgEarth/TileKey>
+#include <osgEarth/XmlUtils>
+#include <osgEarth/URI>
+#include <osgEarthFeatures/FeatureSource>
+#include <osgEarthFeatures/FeatureCursor>
+#include <osg/Timer>
+#include <osg/Image>
+#include <osg/Shape>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <math.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace osgEarth;
+using namespace osgEarth::Features;
+
+typedef enum
+{
+	Replay_Image = 0,
+	Replay_Elevation,
+	Replay_GS_Features,
+	Replay_GT_Features,
+	Replay_Kind_Count
+} Replay_Kind;
+
+static const char * s_KindNames[Replay_Kind_Count] = { "image", "elevation", "gs_features", "gt_features" };
+
+struct ReplayOptions
+{
+	std::string					TraceFile;
+	std::string					EarthFile;
+	std::string					Root;
+	int							Threads;
+	int							Repeat;
+	bool						Realtime;
+	bool						Stats;
+	std::vector<std::string>	Overrides;
+	std::string					Label;
+	std::string					JsonFile;
+	ReplayOptions() : Threads(4), Repeat(1), Realtime(false), Stats(false)
+	{
+	}
+};
+
+struct ReplayRequest
+{
+	Replay_Kind	Kind;
+	unsigned	Lod;
+	unsigned	X;
+	unsigned	Y;
+	double		Secs;
+};
+
+struct ReplaySeries
+{
+	std::vector<double>	Samples_ms;
+	int					Empty;
+	GIntBig				Features;
+	ReplaySeries() : Empty(0), Features(0)
+	{
+	}
+};
+
+//The layers the trace is replayed against, one of each kind
+struct ReplayLayers
+{
+	osg::ref_ptr<TileSource>	Image;
+	osg::ref_ptr<TileSource>	Elevation;
+	osg::ref_ptr<FeatureSource>	Features[2];
+};
+
+static double elapsed_ms(osg::Timer_t start)
+{
+	return osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+}
+
+static std::string json_escape(const std::string &in)
+{
+	std::string out;
+	for (size_t i = 0; i < in.size(); ++i)
+	{
+		char c = in[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if ((unsigned char)c < 0x20)
+			out += ' ';
+		else
+			out += c;
+	}
+	return out;
+}
+
+static double percentile(std::vector<double> &sorted, double pct)
+{
+	if (sorted.empty())
+		return 0.0;
+	size_t idx = (size_t)ceil((pct / 100.0) * (double)sorted.size());
+	if (idx > 0)
+		--idx;
+	if (idx >= sorted.size())
+		idx = sorted.size() - 1;
+	return sorted[idx];
+}
+
+//Peak resident set size of the process in kilobytes
+static GIntBig peak_rss_kb(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return (GIntBig)(counters.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (GIntBig)(usage.ru_maxrss / 1024);
+#else
+	return (GIntBig)usage.ru_maxrss;
+#endif
+#endif
+}
+
+static bool kind_from_name(const std::string &name, Replay_Kind &kind)
+{
+	for (int k = 0; k < Replay_Kind_Count; ++k)
+	{
+		if (name == s_KindNames[k])
+		{
+			kind = (Replay_Kind)k;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void apply_overrides(Config &conf, ReplayOptions &opts)
+{
+	for (size_t i = 0; i < opts.Overrides.size(); ++i)
+	{
+		std::string::size_type eq = opts.Overrides[i].find('=');
+		if (eq == std::string::npos)
+			continue;
+		conf.update(opts.Overrides[i].substr(0, eq), opts.Overrides[i].substr(eq + 1));
+	}
+}
+
+static TileSource * open_tile_source(Config conf, ReplayOptions &opts, const osgDB::Options *dbOptions)
+{
+	apply_overrides(conf, opts);
+	//The replay is what is being traced
+	conf.remove("trace_file");
+	TileSourceOptions tsOptions(conf);
+	osg::ref_ptr<TileSource> source = TileSourceFactory::create(tsOptions);
+	if (!source.valid())
+		return NULL;
+#if OSGEARTH_VERSION_GREATER_OR_EQUAL (2,7,0)
+	TileSource::Status status = source->open(TileSource::MODE_READ, dbOptions);
+#else
+	TileSource::Status status = source->startup(dbOptions);
+#endif
+	if (status.isError())
+	{
+		std::cerr << "cdb_replay: " << status.message() << std::endl;
+		return NULL;
+	}
+	return source.release();
+}
+
+static FeatureSource * open_feature_source(Config conf, ReplayOptions &opts, const osgDB::Options *dbOptions)
+{
+	apply_overrides(conf, opts);
+	conf.remove("trace_file");
+	FeatureSourceOptions fsOptions(conf);
+	osg::ref_ptr<FeatureSource> source = FeatureSourceFactory::create(fsOptions);
+	if (!source.valid())
+		return NULL;
+	source->initialize(dbOptions);
+	source->getFeatureProfile();
+	return source.release();
+}
+
+static bool is_cdb(const Config &conf)
+{
+	return conf.value("driver") == "cdb";
+}
+
+//Finds the first cdb layer of each kind in the earth file, or makes
+//default layers for the CDB at --root
+static bool open_layers(ReplayOptions &opts, ReplayLayers &layers)
+{
+	osg::ref_ptr<osgDB::Options> dbOptions = Registry::instance()->cloneOrCreateOptions();
+	Config imageConf, elevationConf, featureConf[2];
+	bool haveImage = false, haveElevation = false, haveFeatures[2] = { false, false };
+
+	if (!opts.EarthFile.empty())
+	{
+		osg::ref_ptr<XmlDocument> doc = XmlDocument::load(URI(opts.EarthFile));
+		if (!doc.valid())
+		{
+			std::cerr << "cdb_replay: unable to read " << opts.EarthFile << std::endl;
+			return false;
+		}
+		Config map = doc->getConfig().child("map");
+		for (ConfigSet::const_iterator i = map.children().begin(); i != map.children().end(); ++i)
+		{
+			if ((i->key() == "image") && is_cdb(*i) && !haveImage)
+			{
+				imageConf = *i;
+				haveImage = true;
+			}
+			else if (((i->key() == "elevation") || (i->key() == "heightfield")) && is_cdb(*i) && !haveElevation)
+			{
+				elevationConf = *i;
+				haveElevation = true;
+			}
+			else if ((i->key() == "model") && i->hasChild("features") && is_cdb(i->child("features")))
+			{
+				Config features = i->child("features");
+				int sel = (features.value("geotypical") == "true") ? 1 : 0;
+				if (!haveFeatures[sel])
+				{
+					featureConf[sel] = features;
+					haveFeatures[sel] = true;
+				}
+			}
+		}
+	}
+	else
+	{
+		imageConf = Config("image");
+		elevationConf = Config("elevation");
+		featureConf[0] = Config("features");
+		featureConf[1] = Config("features");
+		featureConf[1].update("geotypical", "true");
+		Config *confs[4] = { &imageConf, &elevationConf, &featureConf[0], &featureConf[1] };
+		for (int c = 0; c < 4; ++c)
+		{
+			confs[c]->update("driver", "cdb");
+			confs[c]->update("root_dir", opts.Root);
+		}
+		haveImage = haveElevation = haveFeatures[0] = haveFeatures[1] = true;
+	}
+
+	if (haveImage)
+		layers.Image = open_tile_source(imageConf, opts, dbOptions.get());
+	if (haveElevation)
+		layers.Elevation = open_tile_source(elevationConf, opts, dbOptions.get());
+	for (int sel = 0; sel < 2; ++sel)
+	{
+		if (haveFeatures[sel])
+			layers.Features[sel] = open_feature_source(featureConf[sel], opts, dbOptions.get());
+	}
+	return layers.Image.valid() || layers.Elevation.valid() || layers.Features[0].valid() || layers.Features[1].valid();
+}
+
+class ReplayWorker : public OpenThreads::Thread
+{
+public:
+	ReplayWorker(ReplayLayers &layers, std::vector<ReplayRequest> &requests, size_t &next, OpenThreads::Mutex &nextMutex,
+				 bool realtime, osg::Timer_t start) :
+		_layers(layers), _requests(requests), _next(next), _nextMutex(nextMutex), _realtime(realtime), _start(start),
+		_series(Replay_Kind_Count)
+	{
+	}
+
+	virtual void run(void)
+	{
+		while (true)
+		{
+			size_t index;
+			{
+				OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_nextMutex);
+				if (_next >= _requests.size())
+					break;
+				index = _next++;
+			}
+			ReplayRequest &request = _requests[index];
+			if (_realtime)
+			{
+				//Issue the request no earlier than it was recorded
+				double wait_ms = (request.Secs * 1000.0) - elapsed_ms(_start);
+				if (wait_ms > 0.0)
+					OpenThreads::Thread::microSleep((unsigned int)(wait_ms * 1000.0));
+			}
+
+			ReplaySeries &series = _series[request.Kind];
+			osg::Timer_t requestStart = osg::Timer::instance()->tick();
+			bool empty = true;
+			if (request.Kind == Replay_Image)
+			{
+				TileKey key(request.Lod, request.X, request.Y, _layers.Image->getProfile());
+				osg::ref_ptr<osg::Image> image = _layers.Image->createImage(key, NULL);
+				empty = !image.valid();
+			}
+			else if (request.Kind == Replay_Elevation)
+			{
+				TileKey key(request.Lod, request.X, request.Y, _layers.Elevation->getProfile());
+				osg::ref_ptr<osg::HeightField> field = _layers.Elevation->createHeightField(key, NULL);
+				empty = !field.valid();
+			}
+			else
+			{
+				FeatureSource *source = _layers.Features[request.Kind == Replay_GT_Features ? 1 : 0].get();
+				Symbology::Query query;
+				query.tileKey() = TileKey(request.Lod, request.X, request.Y, source->getFeatureProfile()->getProfile());
+				osg::ref_ptr<FeatureCursor> cursor = source->createFeatureCursor(query);
+				if (cursor.valid())
+				{
+					while (cursor->hasMore())
+					{
+						osg::ref_ptr<Feature> feature = cursor->nextFeature();
+						++series.Features;
+						empty = false;
+					}
+				}
+			}
+			series.Samples_ms.push_back(elapsed_ms(requestStart));
+			if (empty)
+				++series.Empty;
+		}
+	}
+
+	std::vector<ReplaySeries> &Series(void)
+	{
+		return _series;
+	}
+
+private:
+	ReplayLayers &				_layers;
+	std::vector<ReplayRequest> &_requests;
+	size_t &					_next;
+	OpenThreads::Mutex &		_nextMutex;
+	bool						_realtime;
+	osg::Timer_t				_start;
+	std::vector<ReplaySeries>	_series;
+};
+
+static bool load_requests(ReplayOptions &opts, ReplayLayers &layers, std::vector<ReplayRequest> &requests)
+{
+	CDB_Key_Trace_Entries entries;
+	if (!CDB_Key_Trace::Load(opts.TraceFile, entries))
+	{
+		std::cerr << "cdb_replay: unable to read " << opts.TraceFile << std::endl;
+		return false;
+	}
+
+	int skipped = 0;
+	double traceSecs = entries.empty() ? 0.0 : entries.back().Secs;
+	for (int pass = 0; pass < opts.Repeat; ++pass)
+	{
+		for (CDB_Key_Trace_Entries::iterator e = entries.begin(); e != entries.end(); ++e)
+		{
+			ReplayRequest request;
+			if (!kind_from_name(e->Kind, request.Kind))
+			{
+				++skipped;
+				continue;
+			}
+			bool haveLayer = ((request.Kind == Replay_Image) && layers.Image.valid()) ||
+							 ((request.Kind == Replay_Elevation) && layers.Elevation.valid()) ||
+							 ((request.Kind == Replay_GS_Features) && layers.Features[0].valid()) ||
+							 ((request.Kind == Replay_GT_Features) && layers.Features[1].valid());
+			if (!haveLayer)
+			{
+				++skipped;
+				continue;
+			}
+			request.Lod = e->Lod;
+			request.X = e->X;
+			request.Y = e->Y;
+			request.Secs = e->Secs + (double)pass * traceSecs;
+			requests.push_back(request);
+		}
+	}
+	if (skipped > 0)
+		std::cerr << "cdb_replay: skipped " << skipped << " requests with no matching layer" << std::endl;
+	return true;
+}
+
+static void write_series(std::ostream &out, const std::string &name, ReplaySeries &series, const std::string &indent)
+{
+	std::vector<double> sorted = series.Samples_ms;
+	std::sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (size_t i = 0; i < sorted.size(); ++i)
+		total += sorted[i];
+	double mean = sorted.empty() ? 0.0 : total / (double)sorted.size();
+
+	out << indent << "{\"name\": \"" << json_escape(name) << "\", \"count\": " << sorted.size()
+		<< ", \"empty\": " << series.Empty
+		<< ", \"features\": " << series.Features
+		<< ", \"mean_ms\": " << mean
+		<< ", \"p50_ms\": " << percentile(sorted, 50.0)
+		<< ", \"p95_ms\": " << percentile(sorted, 95.0)
+		<< ", \"p99_ms\": " << percentile(sorted, 99.0)
+		<< ", \"p999_ms\": " << percentile(sorted, 99.9)
+		<< ", \"max_ms\": " << (sorted.empty() ? 0.0 : sorted.back())
+		<< ", \"total_ms\": " << total << "}";
+}
+
+static bool parse_args(int argc, char **argv, ReplayOptions &opts)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = (i + 1 < argc);
+		if (arg == "--trace" && hasValue)
+			opts.TraceFile = argv[++i];
+		else if (arg == "--earth" && hasValue)
+			opts.EarthFile = argv[++i];
+		else if (arg == "--root" && hasValue)
+			opts.Root = argv[++i];
+		else if (arg == "--threads" && hasValue)
+			opts.Threads = std::max(1, atoi(argv[++i]));
+		else if (arg == "--repeat" && hasValue)
+			opts.Repeat = std::max(1, atoi(argv[++i]));
+		else if (arg == "--realtime")
+			opts.Realtime = true;
+		else if (arg == "--set" && hasValue)
+			opts.Overrides.push_back(argv[++i]);
+		else if (arg == "--stats")
+			opts.Stats = true;
+		else if (arg == "--label" && hasValue)
+			opts.Label = argv[++i];
+		else if (arg == "--json" && hasValue)
+			opts.JsonFile = argv[++i];
+		else
+			opts.TraceFile.clear();
+	}
+	if (opts.TraceFile.empty() || (opts.EarthFile.empty() && opts.Root.empty()))
+	{
+		std::cerr << "usage: cdb_replay --trace file (--earth file | --root dir) [--threads n] [--repeat n] [--realtime]" << std::endl
+				  << "                  [--set key=value]... [--stats] [--label text] [--json file]" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	ReplayOptions opts;
+	if (!parse_args(argc, argv, opts))
+		return 1;
+
+	if (opts.Stats)
+		CDB_Stats::Set_Enabled(true);
+
+	ReplayLayers layers;
+	if (!open_layers(opts, layers))
+	{
+		std::cerr << "cdb_replay: no cdb layers could be opened" << std::endl;
+		return 1;
+	}
+
+	std::vector<ReplayRequest> requests;
+	if (!load_requests(opts, layers, requests))
+		return 1;
+	GIntBig startRss = peak_rss_kb();
+
+	std::cerr << "Replaying " << requests.size() << " requests on " << opts.Threads << " threads" << std::endl;
+	size_t next = 0;
+	OpenThreads::Mutex nextMutex;
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	std::vector<ReplayWorker *> workers;
+	for (int t = 0; t < opts.Threads; ++t)
+	{
+		ReplayWorker *worker = new ReplayWorker(layers, requests, next, nextMutex, opts.Realtime, start);
+		worker->start();
+		workers.push_back(worker);
+	}
+	std::vector<ReplaySeries> series(Replay_Kind_Count);
+	ReplaySeries all;
+	for (size_t t = 0; t < workers.size(); ++t)
+	{
+		workers[t]->join();
+		for (int k = 0; k < Replay_Kind_Count; ++k)
+		{
+			ReplaySeries &from = workers[t]->Series()[k];
+			series[k].Samples_ms.insert(series[k].Samples_ms.end(), from.Samples_ms.begin(), from.Samples_ms.end());
+			series[k].Empty += from.Empty;
+			series[k].Features += from.Features;
+			all.Samples_ms.insert(all.Samples_ms.end(), from.Samples_ms.begin(), from.Samples_ms.end());
+			all.Empty += from.Empty;
+			all.Features += from.Features;
+		}
+		delete workers[t];
+	}
+	double wall_ms = elapsed_ms(start);
+
+	std::ofstream file;
+	if (!opts.JsonFile.empty())
+	{
+		file.open(opts.JsonFile.c_str());
+		if (!file)
+		{
+			std::cerr << "cdb_replay: unable to write " << opts.JsonFile << std::endl;
+			return 1;
+		}
+	}
+	std::ostream &out = opts.JsonFile.empty() ? std::cout : file;
+
+	out << "{" << std::endl;
+	out << "  \"benchmark\": \"cdb_replay\"," << std::endl;
+	out << "  \"label\": \"" << json_escape(opts.Label) << "\"," << std::endl;
+	out << "  \"trace\": \"" << json_escape(opts.TraceFile) << "\"," << std::endl;
+	out << "  \"threads\": " << opts.Threads << ", \"repeat\": " << opts.Repeat
+		<< ", \"realtime\": " << (opts.Realtime ? "true" : "false") << "," << std::endl;
+	out << "  \"overrides\": [";
+	for (size_t i = 0; i < opts.Overrides.size(); ++i)
+		out << (i ? ", " : "") << "\"" << json_escape(opts.Overrides[i]) << "\"";
+	out << "]," << std::endl;
+	out << "  \"requests\": " << requests.size() << ", \"wall_ms\": " << wall_ms
+		<< ", \"requests_per_sec\": " << ((wall_ms > 0.0) ? (double)requests.size() / (wall_ms / 1000.0) : 0.0) << "," << std::endl;
+	out << "  \"rss_kb\": {\"before_replay\": " << startRss << ", \"peak\": " << peak_rss_kb() << "}," << std::endl;
+	out << "  \"results\": [" << std::endl;
+	write_series(out, "all", all, "    ");
+	for (int k = 0; k < Replay_Kind_Count; ++k)
+	{
+		if (series[k].Samples_ms.empty())
+			continue;
+		out << "," << std::endl;
+		write_series(out, s_KindNames[k], series[k], "    ");
+	}
+	out << std::endl << "  ]";
+	if (opts.Stats)
+	{
+		std::vector<CDB_Stats_Summary> summary;
+		CDB_Stats::Get_Summary(summary);
+		out << "," << std::endl << "  \"phases\": [" << std::endl;
+		for (size_t i = 0; i < summary.size(); ++i)
+		{
+			CDB_Stats_Summary &s = summary[i];
+			out << "    {\"phase\": \"" << CDB_Stats::Phase_Name(s.Phase) << "\", \"lod\": " << s.Lod << ", \"count\": " << s.Count
+				<< ", \"mean_ms\": " << s.Mean_ms << ", \"p50_ms\": " << s.P50_ms << ", \"p95_ms\": " << s.P95_ms
+				<< ", \"p99_ms\": " << s.P99_ms << ", \"max_ms\": " << s.Max_ms << "}" << ((i + 1 < summary.size()) ? "," : "") << std::endl;
+		}
+		out << "  ]";
+	}
+	out << std::endl << "}" << std::endl;
+	return 0;
+}
@@ -0,0 +1,434 @@
+// Copyright (c) 2016 GAJ Geospatial Enterprises, Orlando FL
+// Created for General Incorporation of Common Database (CDB) support within osgEarth
+
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This file is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+
+// CDBTilePrefetcher.cpp
+//
+
+#include <osgEarth/Notify>
+#include <osgEarth/Profile>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "CDBTilePrefetcher"
+#include "CDBTileSource"
+
+#define LC "[CDB Prefetch] "
+
+using namespace osgEarth;
+
+//Number of recently requested keys used to decide whether a queued prefetch
+//is still in the area the camera is looking at
+#define PREFETCH_RECENT_KEYS 64
+//Number of recently requested ids remembered so they are not prefetched again
+#define PREFETCH_RECENT_IDS 512
+//Distance in tiles (at the coarser of the two lods) that is still considered near
+#define PREFETCH_NEAR_TILES 2
+
+class CDBTilePrefetcher::Entry : public osg::Referenced
+{
+public:
+	enum State
+	{
+		QUEUED = 0,
+		RUNNING = 1,
+		DONE = 2
+	};
+
+	Entry(const TileKey& key, TileKind kind, const std::string& id) : _key(key), _kind(kind), _id(id), _state(QUEUED),
+		_progress(new ProgressCallback())
+	{
+	}
+
+	TileKey								_key;
+	TileKind							_kind;
+	std::string							_id;
+	State								_state;
+	osg::ref_ptr<ProgressCallback>		_progress;
+	osg::ref_ptr<CDB_Thread_Task>		_task;
+	osg::ref_ptr<osg::Image>			_image;
+	osg::ref_ptr<osg::HeightField>		_field;
+};
+
+class CDBTilePrefetcher::PrefetchTask : public CDB_Thread_Task
+{
+public:
+	PrefetchTask(CDBTilePrefetcher* owner, CDBTileSource* source, Entry* entry) : _owner(owner), _source(source), _entry(entry)
+	{
+	}
+
+	virtual void Run(void)
+	{
+		if (!_owner->beginBuild(_entry.get()))
+			return;
+
+		osg::ref_ptr<osg::Image> image;
+		osg::ref_ptr<osg::HeightField> field;
+		if (_entry->_kind == PREFETCH_IMAGE)
+			image = _source->buildImage(_entry->_key, _entry->_progress.get());
+		else
+			field = _source->buildHeightField(_entry->_key, _entry->_progress.get());
+
+		_owner->finishBuild(_entry.get(), image.get(), field.get());
+	}
+
+	virtual bool Is_Cancelled(void)
+	{
+		return m_Cancelled || _entry->_progress->isCanceled();
+	}
+
+private:
+	CDBTilePrefetcher*			_owner;
+	CDBTileSource*				_source;
+	osg::ref_ptr<Entry>			_entry;
+};
+
+
+CDBTilePrefetcher::CDBTilePrefetcher(CDBTileSource* source, int numThreads, int budget, int cacheSize, unsigned maxLevel) :
+	_source(source), _budget(budget), _cacheSize(cacheSize), _maxLevel(maxLevel), _shutdown(false), _outstanding(0),
+	_numScheduled(0), _numHits(0), _numCancelled(0)
+{
+	if (_budget < 1)
+		_budget = 1;
+	if (_cacheSize < 1)
+		_cacheSize = 1;
+	_pool = new CDB_Thread_Pool(numThreads);
+	OE_INFO << LC << "Prefetching with " << _pool->Thread_Count() << " threads, budget " << _budget
+		<< " tiles, cache " << _cacheSize << " tiles" << std::endl;
+}
+
+CDBTilePrefetcher::~CDBTilePrefetcher()
+{
+	shutdown();
+}
+
+void CDBTilePrefetcher::shutdown()
+{
+	{
+		OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+		if (_shutdown)
+			return;
+		_shutdown = true;
+		for (EntryMap::iterator ei = _entries.begin(); ei != _entries.end(); ++ei)
+			ei->second->_progress->cancel();
+		_finished.broadcast();
+	}
+
+	//Joins the workers, so nothing references the tile source after this
+	_pool->Shutdown();
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+	OE_INFO << LC << "Scheduled " << _numScheduled << " Used " << _numHits << " Cancelled " << _numCancelled << std::endl;
+	_entries.clear();
+	_queueOrder.clear();
+	_doneOrder.clear();
+	_outstanding = 0;
+}
+
+osg::Image* CDBTilePrefetcher::takeImage(const TileKey& key, ProgressCallback* progress)
+{
+	osg::ref_ptr<Entry> entry = take(key, PREFETCH_IMAGE, progress);
+	observe(key, PREFETCH_IMAGE);
+	if (entry.valid() && entry->_image.valid())
+		return entry->_image.release();
+	return NULL;
+}
+
+osg::HeightField* CDBTilePrefetcher::takeHeightField(const TileKey& key, ProgressCallback* progress)
+{
+	osg::ref_ptr<Entry> entry = take(key, PREFETCH_HEIGHTFIELD, progress);
+	observe(key, PREFETCH_HEIGHTFIELD);
+	if (entry.valid() && entry->_field.valid())
+		return entry->_field.release();
+	return NULL;
+}
+
+std::string CDBTilePrefetcher::entryId(const TileKey& key, TileKind kind) const
+{
+	return (kind == PREFETCH_IMAGE ? "i" : "h") + key.str();
+}
+
+CDBTilePrefetcher::Entry* CDBTilePrefetcher::take(const TileKey& key, TileKind kind, ProgressCallback* progress)
+{
+	std::string id = entryId(key, kind);
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+	rememberRequest(id, key, kind);
+
+	EntryMap::iterator ei = _entries.find(id);
+	if (ei == _entries.end())
+		return NULL;
+
+	osg::ref_ptr<Entry> entry = ei->second;
+	if (entry->_state == Entry::QUEUED)
+	{
+		//The caller will build it sooner than a worker would get to it
+		entry->_task->Cancel();
+		removeEntry(id);
+		forgetQueued(id);
+		return NULL;
+	}
+
+	//Already being decoded, wait for it rather than decoding it twice.
+	//A cancelled request leaves it to finish for the next request of the key.
+	while (entry->_state == Entry::RUNNING && !_shutdown)
+	{
+		if (progress && progress->isCanceled())
+			return NULL;
+		_finished.wait(&_mutex, 50);
+	}
+
+	//It may have been cancelled or come up empty while we waited
+	ei = _entries.find(id);
+	if (ei == _entries.end() || ei->second.get() != entry.get() || entry->_state != Entry::DONE)
+		return NULL;
+
+	removeEntry(id);
+	++_numHits;
+	return entry.release();
+}
+
+void CDBTilePrefetcher::observe(const TileKey& key, TileKind kind)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+	if (_shutdown)
+		return;
+
+	//Track the direction of travel at the requested lod
+	Motion& motion = _motion[kind];
+	if (motion.valid && motion.lod == key.getLOD())
+	{
+		int dx = (int)key.getTileX() - (int)motion.x;
+		int dy = (int)key.getTileY() - (int)motion.y;
+		if ((dx != 0 || dy != 0) && abs(dx) <= PREFETCH_NEAR_TILES && abs(dy) <= PREFETCH_NEAR_TILES)
+		{
+			motion.dx = (dx > 0) ? 1 : ((dx < 0) ? -1 : 0);
+			motion.dy = (dy > 0) ? 1 : ((dy < 0) ? -1 : 0);
+		}
+	}
+	else
+	{
+		motion.dx = 0;
+		motion.dy = 0;
+	}
+	motion.valid = true;
+	motion.lod = key.getLOD();
+	motion.x = key.getTileX();
+	motion.y = key.getTileY();
+
+	cancelStale(kind);
+
+	//The next lod down is the most likely next request
+	if (key.getLOD() < _maxLevel)
+	{
+		for (unsigned q = 0; q < 4; ++q)
+			schedule(key.createChildKey(q), kind);
+	}
+
+	//Followed by the neighbour we are moving towards
+	if (motion.dx != 0 || motion.dy != 0)
+	{
+		const Profile* profile = key.getProfile();
+		unsigned tiles_x, tiles_y;
+		profile->getNumTiles(key.getLOD(), tiles_x, tiles_y);
+		int nx = (int)key.getTileX() + motion.dx;
+		int ny = (int)key.getTileY() + motion.dy;
+		if (nx >= 0 && ny >= 0 && nx < (int)tiles_x && ny < (int)tiles_y)
+			schedule(TileKey(key.getLOD(), (unsigned)nx, (unsigned)ny, profile), kind);
+	}
+}
+
+void CDBTilePrefetcher::schedule(const TileKey& key, TileKind kind)
+{
+	if (!key.valid())
+		return;
+
+	std::string id = entryId(key, kind);
+	if (_entries.find(id) != _entries.end())
+		return;
+	if (_recentSet.find(id) != _recentSet.end())
+		return;
+
+	//Keep within the I/O budget by giving up on the oldest queued prediction
+	while (_outstanding >= _budget)
+	{
+		bool dropped = false;
+		while (!_queueOrder.empty() && !dropped)
+		{
+			std::string oldest = _queueOrder.front();
+			_queueOrder.pop_front();
+			EntryMap::iterator ei = _entries.find(oldest);
+			if (ei != _entries.end() && ei->second->_state == Entry::QUEUED)
+			{
+				ei->second->_task->Cancel();
+				removeEntry(oldest);
+				++_numCancelled;
+				dropped = true;
+			}
+		}
+		if (!dropped)
+			return;
+	}
+
+	osg::ref_ptr<Entry> entry = new Entry(key, kind, id);
+	entry->_task = new PrefetchTask(this, _source, entry.get());
+	_entries[id] = entry;
+	_queueOrder.push_back(id);
+	++_outstanding;
+	++_numScheduled;
+	_pool->Add_Task(entry->_task.get());
+}
+
+bool CDBTilePrefetcher::isNearRecent(const TileKey& key, TileKind kind)
+{
+	const std::deque<TileKey>& recent = _recentKeys[kind];
+	for (std::deque<TileKey>::const_reverse_iterator ri = recent.rbegin(); ri != recent.rend(); ++ri)
+	{
+		unsigned lod = key.getLOD() < ri->getLOD() ? key.getLOD() : ri->getLOD();
+		int kx = (int)(key.getTileX() >> (key.getLOD() - lod));
+		int ky = (int)(key.getTileY() >> (key.getLOD() - lod));
+		int rx = (int)(ri->getTileX() >> (ri->getLOD() - lod));
+		int ry = (int)(ri->getTileY() >> (ri->getLOD() - lod));
+		if (abs(kx - rx) <= PREFETCH_NEAR_TILES && abs(ky - ry) <= PREFETCH_NEAR_TILES)
+			return true;
+	}
+	return false;
+}
+
+void CDBTilePrefetcher::cancelStale(TileKind kind)
+{
+	//Anything still waiting for a worker that is no longer near what the
+	//camera is asking for is dropped
+	std::deque<std::string> keep;
+	for (std::deque<std::string>::iterator qi = _queueOrder.begin(); qi != _queueOrder.end(); ++qi)
+	{
+		EntryMap::iterator ei = _entries.find(*qi);
+		if (ei == _entries.end() || ei->second->_state != Entry::QUEUED)
+			continue;
+		Entry* entry = ei->second.get();
+		if (entry->_kind == kind && !isNearRecent(entry->_key, kind))
+		{
+			entry->_task->Cancel();
+			removeEntry(*qi);
+			++_numCancelled;
+		}
+		else
+			keep.push_back(*qi);
+	}
+	_queueOrder.swap(keep);
+
+	//Running builds that have wandered out of view are told to stop
+	for (EntryMap::iterator ei = _entries.begin(); ei != _entries.end(); ++ei)
+	{
+		Entry* entry = ei->second.get();
+		if (entry->_state == Entry::RUNNING && entry->_kind == kind && !isNearRecent(entry->_key, kind))
+			entry->_progress->cancel();
+	}
+}
+
+void CDBTilePrefetcher::rememberRequest(const std::string& id, const TileKey& key, TileKind kind)
+{
+	if (_recentSet.insert(id).second)
+	{
+		_recentIds.push_back(id);
+		if (_recentIds.size() > PREFETCH_RECENT_IDS)
+		{
+			_recentSet.erase(_recentIds.front());
+			_recentIds.pop_front();
+		}
+	}
+
+	_recentKeys[kind].push_back(key);
+	if (_recentKeys[kind].size() > PREFETCH_RECENT_KEYS)
+		_recentKeys[kind].pop_front();
+}
+
+bool CDBTilePrefetcher::beginBuild(Entry* entry)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+	if (_shutdown || entry->_state != Entry::QUEUED || entry->_progress->isCanceled())
+		return false;
+	//The id may have been taken, dropped and queued again for a newer entry
+	EntryMap::iterator ei = _entries.find(entry->_id);
+	if (ei == _entries.end() || ei->second.get() != entry)
+		return false;
+	entry->_state = Entry::RUNNING;
+	forgetQueued(entry->_id);
+	return true;
+}
+
+void CDBTilePrefetcher::forgetQueued(const std::string& id)
+{
+	std::deque<std::string>::iterator qi = std::find(_queueOrder.begin(), _queueOrder.end(), id);
+	if (qi != _queueOrder.end())
+		_queueOrder.erase(qi);
+}
+
+void CDBTilePrefetcher::finishBuild(Entry* entry, osg::Image* image, osg::HeightField* field)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+	EntryMap::iterator ei = _entries.find(entry->_id);
+	if (ei == _entries.end() || ei->second.get() != entry)
+	{
+		_finished.broadcast();
+		return;
+	}
+
+	if (entry->_progress->isCanceled() || (!image && !field))
+	{
+		//Nothing worth keeping, the requester will build it if it is needed
+		if (entry->_progress->isCanceled())
+			++_numCancelled;
+		entry->_state = Entry::DONE;
+		removeEntry(entry->_id);
+		_finished.broadcast();
+		return;
+	}
+
+	entry->_image = image;
+	entry->_field = field;
+	entry->_state = Entry::DONE;
+	entry->_task = NULL;
+	--_outstanding;
+	_doneOrder.push_back(entry->_id);
+	evictDone();
+	_finished.broadcast();
+}
+
+void CDBTilePrefetcher::evictDone()
+{
+	while ((int)_doneOrder.size() > _cacheSize)
+	{
+		std::string oldest = _doneOrder.front();
+		_doneOrder.pop_front();
+		EntryMap::iterator ei = _entries.find(oldest);
+		if (ei != _entries.end() && ei->second->_state == Entry::DONE)
+			_entries.erase(ei);
+	}
+}
+
+void CDBTilePrefetcher::removeEntry(const std::string& id)
+{
+	EntryMap::iterator ei = _entries.find(id);
+	if (ei == _entries.end())
+		return;
+	if (ei->second->_state != Entry::DONE || ei->second->_task.valid())
+		--_outstanding;
+	else
+	{
+		std::deque<std::string>::iterator di = std::find(_doneOrder.begin(), _doneOrder.end(), id);
+		if (di != _doneOrder.end())
+			_doneOrder.erase(di);
+	}
+	_entries.erase(ei);
+}
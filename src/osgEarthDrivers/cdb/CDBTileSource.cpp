@@ -25,25 +25,136 @@
 #include <osgEarth/URI>
 #include <osgEarth/TileSource>
 #include <osgEarth/ImageToHeightFieldConverter>
+#include <osg/CopyOp>
+#include <osgDB/FileUtils>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Condition>
 
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #include "CDBTileSource"
 #include "CDBOptions"
 #include <CDB_TileLib/CDB_Tile>
+#include <CDB_TileLib/CDB_Key_Trace>
+#include <CDB_TileLib/CDB_Buffer_Pool>
 
 
 using namespace osgEarth;
 
+//The CDB lod the request stats for the key are kept under
+static int statsLod(const osgEarth::TileKey& key)
+{
+	if (!CDB_Stats::Is_Enabled())
+		return 0;
+	const GeoExtent key_extent = key.getExtent();
+	CDB_Tile_Extent tileExtent(key_extent.north(), key_extent.south(), key_extent.east(), key_extent.west());
+	return CDB_Tile::Get_Extent_Lod(tileExtent);
+}
+
+//Single flight coalescing of cache tile builds. The first request for a cache
+//file builds it while any other request for the same file waits for the result.
+//Keyed by the cache file name so layers sharing a cache directory are covered.
+class CDBCacheFlight : public osg::Referenced
+{
+public:
+	CDBCacheFlight() : _done(false), _cancelled(false), _waiters(0)
+	{
+	}
+
+	bool						_done;
+	bool						_cancelled;
+	int							_waiters;
+	osg::ref_ptr<osg::Object>	_result;
+};
+typedef std::map<std::string, osg::ref_ptr<CDBCacheFlight> > CDBCacheFlightMap;
+
+static OpenThreads::Mutex s_CacheFlightMutex;
+static OpenThreads::Condition s_CacheFlightDone;
+static CDBCacheFlightMap s_CacheFlights;
+
+//Returns the flight for the file. If leader is set the caller must build the
+//tile and call finishCacheFlight, otherwise the build is complete and the
+//result (if any) can be copied from the flight. Returns NULL if the caller
+//was cancelled while waiting.
+static CDBCacheFlight* joinCacheFlight(const std::string& name, osgEarth::ProgressCallback* progress, bool& leader)
+{
+	leader = false;
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_CacheFlightMutex);
+	while (true)
+	{
+		CDBCacheFlightMap::iterator fi = s_CacheFlights.find(name);
+		if (fi == s_CacheFlights.end())
+		{
+			osg::ref_ptr<CDBCacheFlight> flight = new CDBCacheFlight();
+			s_CacheFlights[name] = flight;
+			leader = true;
+			return flight.release();
+		}
+
+		osg::ref_ptr<CDBCacheFlight> flight = fi->second;
+		++flight->_waiters;
+		while (!flight->_done)
+		{
+			if (progress && progress->isCanceled())
+			{
+				--flight->_waiters;
+				return NULL;
+			}
+			s_CacheFlightDone.wait(&s_CacheFlightMutex, 50);
+		}
+		--flight->_waiters;
+
+		//If the leader gave up part way through, try again ourselves
+		if (!flight->_cancelled)
+			return flight.release();
+	}
+}
+
+static void finishCacheFlight(const std::string& name, CDBCacheFlight* flight, osg::Object* result, osgEarth::ProgressCallback* progress)
+{
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_CacheFlightMutex);
+	//The leader's result is handed back to its caller, the waiters get their own copy
+	if (result && (flight->_waiters > 0))
+		flight->_result = osg::clone(result, osg::CopyOp::DEEP_COPY_ALL);
+	flight->_cancelled = (result == NULL) && progress && progress->isCanceled();
+	flight->_done = true;
+	CDBCacheFlightMap::iterator fi = s_CacheFlights.find(name);
+	if ((fi != s_CacheFlights.end()) && (fi->second.get() == flight))
+		s_CacheFlights.erase(fi);
+	s_CacheFlightDone.broadcast();
+}
+
 
 CDBTileSource::CDBTileSource( const osgEarth::TileSourceOptions& options ) : TileSource(options), _options(options), _UseCache(false), _rootDir(""), _cacheDir(""), 
-																			_tileSize(1024), _dataSet("_S001_T001_")
+																			_tileSize(1024), _dataSet("_S001_T001_"), _maxLevel(0),
+																			_zoneProfile(false), _textureCompression(0),
+																			_constantTiles(false)
 {
 
 }   
 
+CDBTileSource::~CDBTileSource()
+{
+	//The prefetch threads call back into this object so they must be stopped first
+	if (_prefetcher.valid())
+	{
+		_prefetcher->shutdown();
+		_prefetcher = NULL;
+	}
+
+	CDB_Cancel_Stats stats = CDB_Tile::Get_Cancel_Stats();
+	if (stats.Cancelled_Builds > 0)
+	{
+		OE_INFO "CDB cancelled builds " << stats.Cancelled_Builds << " decode time wasted " << stats.Wasted_Secs
+			<< "s saved " << stats.Saved_Secs << "s of " << stats.Decode_Secs << "s over " << stats.Decodes << " decodes" << std::endl;
+	}
+}
+
 
 // CDB uses unprojected lat/lon
 osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbOptions)
@@ -84,6 +195,112 @@ osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbO
    }
    
 
+   //How the negative lod cache tiles are written
+   if (_options.CacheCompression().isSet())
+   {
+	   _cacheFormat.Compression = _options.CacheCompression().value();
+	   //Compressed tiles read back faster in blocks
+	   _cacheFormat.Tiled = true;
+   }
+   if (_options.CachePredictor().isSet())
+	   _cacheFormat.Predictor = _options.CachePredictor().value();
+   if (_options.CacheCompressionLevel().isSet())
+	   _cacheFormat.Level = _options.CacheCompressionLevel().value();
+   if (_options.CacheMaxZError().isSet())
+	   _cacheFormat.Max_Z_Error = _options.CacheMaxZError().value();
+   if (_options.CacheTiled().isSet())
+	   _cacheFormat.Tiled = _options.CacheTiled().value();
+   if (_options.CacheBlockSize().isSet())
+	   _cacheFormat.Block_Size = _options.CacheBlockSize().value();
+   if (_options.CacheOverviews().isSet())
+	   _cacheFormat.Overviews = _options.CacheOverviews().value();
+   if (_options.CacheElevationFormat().isSet())
+   {
+	   std::string elevFormat = _options.CacheElevationFormat().value();
+	   if ((elevFormat == "gtiff") || (elevFormat == "GTiff") || (elevFormat == "tif"))
+		   _cacheFormat.Elevation_GTiff = true;
+	   else if ((elevFormat != "hfa") && (elevFormat != "HFA") && (elevFormat != "img"))
+		   OE_WARN << "Unknown CDB cache elevation format " << elevFormat << " using hfa" << std::endl;
+   }
+   if (_options.CacheCreationOptions().isSet())
+	   _cacheFormat.Creation_Options = _options.CacheCreationOptions().value();
+
+   //Keep the cache tiles of each layer in a single packed file instead of one file per tile
+   bool packedCache = false;
+   if (_options.CacheStore().isSet())
+   {
+	   std::string cacheStore = _options.CacheStore().value();
+	   if ((cacheStore == "packed") || (cacheStore == "Packed"))
+		   packedCache = true;
+	   else if ((cacheStore != "files") && (cacheStore != "Files"))
+		   OE_WARN << "Unknown CDB cache store " << cacheStore << " using files" << std::endl;
+   }
+
+   //Per phase latency histograms, shared by all of the CDB layers in the process
+   if (_options.Stats().isSet() && _options.Stats().value())
+   {
+	   CDB_Stats::Set_Enabled(true);
+	   if (_options.StatsDumpInterval().isSet())
+		   CDB_Stats::Set_Dump_Interval(_options.StatsDumpInterval().value());
+   }
+
+   //Threads used to read the geocells of tiles spanning several geocells in parallel
+   if (_options.CompositeThreads().isSet())
+	   CDB_Tile::Set_Composite_Threads(_options.CompositeThreads().value());
+
+   //Megabytes of decoded CDB tiles kept for the neighbouring keys that sample them
+   if (_options.DecodedCacheSize().isSet())
+	   CDB_Tile::Set_Decoded_Cache_Size(_options.DecodedCacheSize().value());
+
+   //Megabytes of tile pixel buffers kept for reuse by the next tiles
+   if (_options.BufferPoolSize().isSet())
+	   CDB_Buffer_Pool::Set_Retained_Size(_options.BufferPoolSize().value());
+
+   //JPEG 2000 driver used for the imagery, auto times the available drivers on a tile of this CDB
+   if (_options.JP2DecodeThreads().isSet())
+	   CDB_Tile::Set_JP2_Decode_Threads(_options.JP2DecodeThreads().value());
+   if (_options.JP2Driver().isSet() && !errorset)
+   {
+	   std::string jp2Driver = _options.JP2Driver().value();
+	   if (jp2Driver == "auto")
+	   {
+		   std::string results = "";
+		   if (_options.JP2CalibrationFile().isSet())
+			   results = _options.JP2CalibrationFile().value();
+		   else if (_UseCache)
+			   results = _cacheDir + "/jp2_calibration.txt";
+		   std::string sample = CDB_Tile::Find_Sample_JP2(_rootDir);
+		   if (sample.empty())
+			   OE_WARN << "CDB found no imagery to calibrate the JP2 drivers with" << std::endl;
+		   else if (!CDB_Tile::Calibrate_JP2_Drivers(sample, results))
+			   OE_WARN << "CDB JP2 driver calibration failed" << std::endl;
+	   }
+	   else if (!CDB_Tile::Set_JP2_Driver(jp2Driver))
+		   OE_WARN << "CDB JP2 driver " << jp2Driver << " is not available" << std::endl;
+   }
+   if (!errorset)
+	   OE_INFO << "CDB using JP2 driver " << CDB_Tile::Get_JP2_Driver() << std::endl;
+
+   //Hand the imagery to osgEarth already compressed, with its mipmaps
+   if (_options.DxtCompression().isSet())
+   {
+	   std::string compression = _options.DxtCompression().value();
+	   if ((compression == "dxt1") || (compression == "bc1"))
+		   _textureCompression = 2;
+	   else if ((compression == "dxt1_nomip") || (compression == "bc1_nomip"))
+		   _textureCompression = 1;
+	   else if (compression != "none")
+		   OE_WARN << "CDB dxt_compression " << compression << " is not supported: Using uncompressed imagery" << std::endl;
+   }
+
+   //Uniform tiles, open ocean for instance, are returned as a single pixel or a 2x2 heightfield
+   if (_options.ConstantTiles().isSet())
+	   _constantTiles = _options.ConstantTiles().value();
+
+   //Record the requested keys for replay with cdb_replay
+   if (_options.TraceFile().isSet())
+	   CDB_Key_Trace::Open(_options.TraceFile().value());
+
    //verify tilesize
    if (_options.tileSize().isSet())
 	   _tileSize = _options.tileSize().value();
@@ -126,15 +343,6 @@ osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbO
 		   int subfact = 2 << Number_of_Negitive_LODs_to_Use;  //2 starts with lod 0 this means howerver a minumum of 4 geocells will be requested even if only one
 		   if ((max_lon > min_lon) && (max_lat > min_lat))	   //is specified in the limits section of the earth file.
 		   {
-			   unsigned tiles_x = (unsigned)(max_lon - min_lon);
-			   int modx = tiles_x % subfact;
-			   if (modx != 0)
-			   {
-				   tiles_x = ((tiles_x + subfact) / subfact) * subfact;
-				   max_lon = min_lon + (double)tiles_x;
-			   }
-			   tiles_x /= subfact;
-
 			   unsigned tiles_y = (unsigned)(max_lat - min_lat);
 			   int mody = tiles_y % subfact;
 			   if (mody != 0)
@@ -144,21 +352,62 @@ osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbO
 			   }
 			   tiles_y /= subfact;
 
+			   //In a zone profile the keys are as wide as the CDB tiles of the longitude zone
+			   //the limits are in so every key is one CDB tile and nothing is resampled
+			   double lon_step = 1.0;
+			   if (_options.ZoneProfile().isSet() && _options.ZoneProfile().value())
+			   {
+				   lon_step = CDB_Tile::Get_Lon_Step(min_lat);
+				   if (CDB_Tile::Get_Lon_Step(max_lat - 1.0) != lon_step)
+				   {
+					   OE_WARN << "CDB Limits span more than one CDB longitude zone: Not using zone_profile" << std::endl;
+					   lon_step = 1.0;
+				   }
+				   else
+				   {
+					   min_lon = floor(min_lon / lon_step) * lon_step;
+					   max_lon = ceil(max_lon / lon_step) * lon_step;
+					   _zoneProfile = true;
+				   }
+			   }
+
+			   unsigned tiles_x = (unsigned)round((max_lon - min_lon) / lon_step);
+			   int modx = tiles_x % subfact;
+			   if (modx != 0)
+			   {
+				   tiles_x = ((tiles_x + subfact) / subfact) * subfact;
+				   max_lon = min_lon + (double)tiles_x * lon_step;
+			   }
+			   tiles_x /= subfact;
+
 			   //Create the Profile with the calculated limitations
 			   osg::ref_ptr<const SpatialReference> src_srs;
 			   src_srs = SpatialReference::create("EPSG:4326");
 			   GeoExtent extents = GeoExtent(src_srs, min_lon, min_lat, max_lon, max_lat);
-			   getDataExtents().push_back(DataExtent(extents, 0, maxcdbdatalevel+Number_of_Negitive_LODs_to_Use+1)); //plus number of sublevels
+			   _maxLevel = maxcdbdatalevel + Number_of_Negitive_LODs_to_Use + 1;
+			   getDataExtents().push_back(DataExtent(extents, 0, _maxLevel)); //plus number of sublevels
 			   setProfile(osgEarth::Profile::create(src_srs, min_lon, min_lat, max_lon, max_lat, tiles_x, tiles_y));
 
 			   OE_INFO "CDB Profile Min Lon " << min_lon << " Min Lat " << min_lat << " Max Lon " << max_lon << " Max Lat " << max_lat << "Tiles " << tiles_x << " " << tiles_y << std::endl;
 			   OE_INFO "  Number of negitive lods " << Number_of_Negitive_LODs_to_Use << " Subfact " << subfact << std::endl;
+			   if (_zoneProfile)
+				   OE_INFO "  Zone profile " << lon_step << " degree CDB tiles" << std::endl;
 			   profile_set = true;
 		   }
 	   }
 	   if (!profile_set)
 		   OE_WARN << "Invalid Limits received by CDB Driver: Not using Limits" << std::endl;
 
+   }
+   else if (_options.ZoneProfile().isSet() && _options.ZoneProfile().value())
+	   OE_WARN << "CDB zone_profile requires Limits within one CDB longitude zone: Not using zone_profile" << std::endl;
+
+   //The zone profile cache tiles cover a different area than the default cache tiles of the same name
+   if (_zoneProfile && _UseCache)
+   {
+	   _cacheDir += "/Zone_Profile";
+	   osgDB::makeDirectory(_cacheDir + "/001_Elevation");
+	   osgDB::makeDirectory(_cacheDir + "/004_Imagery");
    }
 
 	   // Always a WGS84 unprojected lat/lon profile.
@@ -169,7 +418,8 @@ osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbO
 	   osg::ref_ptr<const SpatialReference> src_srs;
 	   src_srs = SpatialReference::create("EPSG:4326");
 	   GeoExtent extents = GeoExtent(SpatialReference::create("EPSG:4326"), -180.0, -90.0, 180.0, 90.0);
-	   getDataExtents().push_back(DataExtent(extents, 0, maxcdbdatalevel + Number_of_Negitive_LODs_to_Use));
+	   _maxLevel = maxcdbdatalevel + Number_of_Negitive_LODs_to_Use;
+	   getDataExtents().push_back(DataExtent(extents, 0, _maxLevel));
 	   setProfile(osgEarth::Profile::create(src_srs, -180.0, -102.0, 204.0, 90.0, 6U, 3U));
 	   if (!_UseCache)
 	   {
@@ -199,44 +449,87 @@ osgEarth::TileSource::Status CDBTileSource::initialize(const osgDB::Options* dbO
 	   }
    }
 
+   //Registered once the cache directory is final (zone profile and default directories), the
+   //tiles find their store by the exact directory they are given
+   if (_UseCache && packedCache)
+	   CDB_Cache_Store::Use_Packed_Cache(_cacheDir);
+
    if (errorset)
    {
 	   osgEarth::TileSource::Status Rstatus(Errormsg);
 	   return Rstatus;
    }
-   else
-	   return STATUS_OK;
+
+   //Start the background prefetch of the tiles likely to be requested next
+   if (_options.Prefetch().isSet() && _options.Prefetch().value())
+   {
+	   int prefetchThreads = 2;
+	   int prefetchBudget = 16;
+	   int prefetchCacheSize = 32;
+	   if (_options.PrefetchThreads().isSet())
+		   prefetchThreads = _options.PrefetchThreads().value();
+	   if (_options.PrefetchBudget().isSet())
+		   prefetchBudget = _options.PrefetchBudget().value();
+	   if (_options.PrefetchCacheSize().isSet())
+		   prefetchCacheSize = _options.PrefetchCacheSize().value();
+	   _prefetcher = new CDBTilePrefetcher(this, prefetchThreads, prefetchBudget, prefetchCacheSize, _maxLevel);
+   }
+   return STATUS_OK;
 }
 
 
 osg::Image* CDBTileSource::createImage(const osgEarth::TileKey& key,
 										osgEarth::ProgressCallback* progress )
 {
+	CDB_Key_Trace::Record("image", key.getLOD(), key.getTileX(), key.getTileY());
+	CDB_Stats_Timer request_timer(CDB_Stat_Image_Request, statsLod(key));
+	if (_prefetcher.valid())
+	{
+		osg::Image *prefetched = _prefetcher->takeImage(key, progress);
+		if (prefetched)
+			return prefetched;
+		if (progress && progress->isCanceled())
+			return NULL;
+	}
+	return buildImage(key, progress);
+}
+
+osg::Image* CDBTileSource::buildImage(const osgEarth::TileKey& key,
+									   osgEarth::ProgressCallback* progress )
+{
 
 	osg::Image *ret_Image = NULL;
 
+	//The pager has already given up on this tile
+	if (progress && progress->isCanceled())
+		return NULL;
+
 	const GeoExtent key_extent = key.getExtent();
 	CDB_Tile_Type tiletype = Imagery;
 	CDB_Tile_Extent tileExtent(key_extent.north(), key_extent.south(), key_extent.east(), key_extent.west());
 	CDB_Tile *mainTile = new CDB_Tile(_rootDir, _cacheDir, tiletype, _dataSet, &tileExtent);
+	mainTile->Set_Cache_Format(_cacheFormat);
 	std::string base = mainTile->FileName();
 	int cdbLod = mainTile->CDB_LOD_Num();
+	//Read at the size the layer asked for. Cache tiles still to be built keep the CDB size.
+	if ((cdbLod >= 0) || mainTile->Tile_Exists())
+		mainTile->Set_Output_Size(_tileSize);
 	if (cdbLod >= 0)
 	{
-		if (CDB_Tile::Get_Lon_Step(tileExtent.South) == 1.0)
+		if (_zoneProfile || (CDB_Tile::Get_Lon_Step(tileExtent.South) == 1.0))
 		{
 			if (mainTile->Tile_Exists())
 			{
-				mainTile->Load_Tile();
-				ret_Image = mainTile->Image_From_Tile();
+				mainTile->Load_Tile(progress);
+				ret_Image = imageFromTile(mainTile);
 			}
 		}
 		else
 		{
-			if (mainTile->Build_Earth_Tile())
+			if (mainTile->Build_Earth_Tile(progress))
 			{
 				OE_DEBUG "Imagery Built Earth Tile " << key.str() << "=" << base << std::endl;
-				ret_Image = mainTile->Image_From_Tile();
+				ret_Image = imageFromTile(mainTile);
 			}
 		}
 	}
@@ -244,14 +537,36 @@ osg::Image* CDBTileSource::createImage(const osgEarth::TileKey& key,
 	{
 		if (mainTile->Tile_Exists())
 		{
-			mainTile->Load_Tile();
-			ret_Image = mainTile->Image_From_Tile();
+			mainTile->Load_Tile(progress);
+			ret_Image = imageFromTile(mainTile);
 		}
 		else
 		{
-			if (mainTile->Build_Cache_Tile(_UseCache))
+			bool leader = false;
+			osg::ref_ptr<CDBCacheFlight> flight = joinCacheFlight(base, progress, leader);
+			if (leader)
+			{
+				//The leader before us may have written the tile since we looked for it
+				CDB_Tile *cacheTile = new CDB_Tile(_rootDir, _cacheDir, tiletype, _dataSet, &tileExtent);
+				cacheTile->Set_Cache_Format(_cacheFormat);
+				if (cacheTile->Tile_Exists())
+				{
+					cacheTile->Set_Output_Size(_tileSize);
+					cacheTile->Load_Tile(progress);
+					ret_Image = imageFromTile(cacheTile);
+				}
+				else if (mainTile->Build_Cache_Tile(_UseCache, progress))
+				{
+					ret_Image = imageFromTile(mainTile);
+				}
+				delete cacheTile;
+				finishCacheFlight(base, flight.get(), ret_Image, progress);
+			}
+			else if (flight.valid())
 			{
-				ret_Image = mainTile->Image_From_Tile();
+				osg::Image* shared = dynamic_cast<osg::Image*>(flight->_result.get());
+				if (shared)
+					ret_Image = osg::clone(shared, osg::CopyOp::DEEP_COPY_ALL);
 			}
 		}
 	}
@@ -269,34 +584,73 @@ osg::Image* CDBTileSource::createImage(const osgEarth::TileKey& key,
 
 }
 
+osg::Image* CDBTileSource::imageFromTile(CDB_Tile* tile)
+{
+	if (_constantTiles && tile->Is_Constant())
+		return tile->Constant_Image();
+	if (_textureCompression > 0)
+		return tile->Compressed_Image_From_Tile(_textureCompression > 1);
+	return tile->Image_From_Tile();
+}
+
+osg::HeightField* CDBTileSource::heightFieldFromTile(CDB_Tile* tile)
+{
+	if (_constantTiles && tile->Is_Constant())
+		return tile->Constant_HeightField();
+	return tile->HeightField_From_Tile();
+}
+
 osg::HeightField* CDBTileSource::createHeightField(const osgEarth::TileKey& key,
    osgEarth::ProgressCallback* progress )
 {
+	CDB_Key_Trace::Record("elevation", key.getLOD(), key.getTileX(), key.getTileY());
+	CDB_Stats_Timer request_timer(CDB_Stat_HeightField_Request, statsLod(key));
+	if (_prefetcher.valid())
+	{
+		osg::HeightField *prefetched = _prefetcher->takeHeightField(key, progress);
+		if (prefetched)
+			return prefetched;
+		if (progress && progress->isCanceled())
+			return NULL;
+	}
+	return buildHeightField(key, progress);
+}
+
+osg::HeightField* CDBTileSource::buildHeightField(const osgEarth::TileKey& key,
+   osgEarth::ProgressCallback* progress )
+{
 
 	osg::HeightField* ret_Field = NULL;
 
+	if (progress && progress->isCanceled())
+		return NULL;
+
 	const GeoExtent key_extent = key.getExtent();
 	CDB_Tile_Type tiletype = Elevation;
 	CDB_Tile_Extent tileExtent(key_extent.north(), key_extent.south(), key_extent.east(), key_extent.west());
 	CDB_Tile *mainTile = new CDB_Tile(_rootDir, _cacheDir, tiletype, _dataSet, &tileExtent);
+	mainTile->Set_Cache_Format(_cacheFormat);
 	std::string base = mainTile->FileName();
 	int cdbLod = mainTile->CDB_LOD_Num();
+	//Read at the size the layer asked for. Cache tiles still to be built keep the CDB size.
+	if ((cdbLod >= 0) || mainTile->Tile_Exists())
+		mainTile->Set_Output_Size(_tileSize);
 
 	if (cdbLod >= 0)
 	{
-		if (CDB_Tile::Get_Lon_Step(tileExtent.South) == 1.0)
+		if (_zoneProfile || (CDB_Tile::Get_Lon_Step(tileExtent.South) == 1.0))
 		{
 			if (mainTile->Tile_Exists())
 			{
-				mainTile->Load_Tile();
-				ret_Field = mainTile->HeightField_From_Tile();
+				mainTile->Load_Tile(progress);
+				ret_Field = heightFieldFromTile(mainTile);
 			}
 		}
 		else
 		{
-			if (mainTile->Build_Earth_Tile())
+			if (mainTile->Build_Earth_Tile(progress))
 			{
-				ret_Field = mainTile->HeightField_From_Tile();
+				ret_Field = heightFieldFromTile(mainTile);
 				OE_DEBUG "Elevation Built Earth Tile " << key.str() << "=" << base << std::endl;
 			}
 		}
@@ -305,14 +659,36 @@ osg::HeightField* CDBTileSource::createHeightField(const osgEarth::TileKey& key,
 	{
 		if (mainTile->Tile_Exists())
 		{
-			mainTile->Load_Tile();
-			ret_Field = mainTile->HeightField_From_Tile();
+			mainTile->Load_Tile(progress);
+			ret_Field = heightFieldFromTile(mainTile);
 		}
 		else
 		{
-			if (mainTile->Build_Cache_Tile(_UseCache))
+			bool leader = false;
+			osg::ref_ptr<CDBCacheFlight> flight = joinCacheFlight(base, progress, leader);
+			if (leader)
+			{
+				//The leader before us may have written the tile since we looked for it
+				CDB_Tile *cacheTile = new CDB_Tile(_rootDir, _cacheDir, tiletype, _dataSet, &tileExtent);
+				cacheTile->Set_Cache_Format(_cacheFormat);
+				if (cacheTile->Tile_Exists())
+				{
+					cacheTile->Set_Output_Size(_tileSize);
+					cacheTile->Load_Tile(progress);
+					ret_Field = heightFieldFromTile(cacheTile);
+				}
+				else if (mainTile->Build_Cache_Tile(_UseCache, progress))
+				{
+					ret_Field = heightFieldFromTile(mainTile);
+				}
+				delete cacheTile;
+				finishCacheFlight(base, flight.get(), ret_Field, progress);
+			}
+			else if (flight.valid())
 			{
-				ret_Field = mainTile->HeightField_From_Tile();
+				osg::HeightField* shared = dynamic_cast<osg::HeightField*>(flight->_result.get());
+				if (shared)
+					ret_Field = osg::clone(shared, osg::CopyOp::DEEP_COPY_ALL);
 			}
 		}
 	}
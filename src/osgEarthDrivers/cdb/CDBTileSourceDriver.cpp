@@ -21,7 +21,7 @@
 // CDBTileSourceDriver.cpp
 //
 
-#include <osgDB\FileNameUtils>
+#include <osgDB/FileNameUtils>
 
 #include "CDBTileSource"
 #include "CDBTileSourceDriver"
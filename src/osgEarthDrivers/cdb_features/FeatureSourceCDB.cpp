@@ -21,6 +21,8 @@
 
 #include "CDBFeatureOptions"
 #include <CDB_TileLib/CDB_Tile>
+#include <CDB_TileLib/CDB_Key_Trace>
+#include <CDB_TileLib/CDB_Elevation_Sampler>
 
 #include <osgEarth/Version>
 #include <osgEarth/Registry>
@@ -33,10 +35,14 @@
 #include <osgEarthFeatures/OgrUtils>
 #include <osgEarthUtil/TFS>
 #include <osg/Notify>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Condition>
 #include <osgDB/FileNameUtils>
 #include <osgDB/FileUtils>
 #include <osgDB/Archive>
 #include <list>
+#include <map>
 #include <vector>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,6 +59,8 @@
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #define LC "[CDB FeatureSource] "
@@ -86,7 +94,45 @@ typedef std::map<std::string, CDBUnrefEntryVec> CDBUnrefEntryMap;
 static CDBEntryMap				_CDBInstances;
 static CDBUnrefEntryMap			_CDBUnReffedInstances;
 
-static __int64 _s_CDB_FeatureID = 0;
+static GIntBig _s_CDB_FeatureID = 0;
+
+//Cells per side of the grid indexing the instances of a CDB tile read for finer keys
+#define CDB_INDEX_GRID 16
+
+//The instances of one CDB tile bucketed by position, read once and shared by all the keys inside the tile.
+//Nothing changes once Ready is set, so the keys read it without the lock.
+class CDBFeatureTileIndex : public osg::Referenced
+{
+public:
+	CDBFeatureTileIndex() : Ready(false), DataOK(false)
+	{
+	}
+
+	bool Ready;
+	bool DataOK;
+	std::vector<osg::ref_ptr<Feature> > Features;
+	std::vector<osg::Vec2d> Positions;
+	std::vector<std::vector<unsigned> > Cells;
+};
+
+typedef std::map<std::string, osg::ref_ptr<CDBFeatureTileIndex> > CDBFeatureTileIndexMap;
+
+//Where the read of one selection of a CDB tile is between chunks
+struct CDBFeatureReadStateData {
+	int Sel;
+	std::string Buffer;
+	std::string TileNameStr;
+	std::string ModelTextureDir;
+	std::string ModelZipFile;
+	std::string TextureZipFile;
+	std::string ModelZipDir;
+	bool Have_Archive;
+	bool Have_Texture_Zipfile;
+	bool Done;
+	int Feature_Cnt;
+};
+
+typedef CDBFeatureReadStateData CDBFeatureReadState;
 /**
  * A FeatureSource that reads Common Database Layers
  * 
@@ -102,7 +148,11 @@ public:
 	  _CDB_GS_uses_GTtex(false),
 	  _CDB_No_Second_Ref(true),
 	  _CDB_Edit_Support(false),
-	  _cur_Feature_Cnt(0),
+	  _CDB_Clamp_To_Elevation(false),
+	  _CDB_Clamp_Lod(-1),
+	  _CDB_Max_Lod(-1),
+	  _CDB_Index_Cache_Size(16),
+	  _CDB_Chunk_Size(500),
 	  _rootString(""),
 	  _cacheDir(""),
 	  _dataSet("_S001_T001_")
@@ -140,6 +190,24 @@ public:
 			_CDB_Edit_Support = _options.Edit_Support().value();
 		if (_options.No_Second_Ref().isSet())
 			_CDB_No_Second_Ref = _options.No_Second_Ref().value();
+		if (_options.Stats().isSet() && _options.Stats().value())
+		{
+			CDB_Stats::Set_Enabled(true);
+			if (_options.Stats_Dump_Interval().isSet())
+				CDB_Stats::Set_Dump_Interval(_options.Stats_Dump_Interval().value());
+		}
+		if (_options.Trace_File().isSet())
+			CDB_Key_Trace::Open(_options.Trace_File().value());
+		if (_options.Clamp_To_Elevation().isSet())
+			_CDB_Clamp_To_Elevation = _options.Clamp_To_Elevation().value();
+		if (_options.Clamp_Lod().isSet())
+			_CDB_Clamp_Lod = _options.Clamp_Lod().value();
+		if (_options.Max_CDB_Lod().isSet())
+			_CDB_Max_Lod = _options.Max_CDB_Lod().value();
+		if (_options.Index_Cache_Size().isSet())
+			_CDB_Index_Cache_Size = osg::maximum(_options.Index_Cache_Size().value(), 1);
+		if (_options.Chunk_Size().isSet())
+			_CDB_Chunk_Size = _options.Chunk_Size().value();
 		if (_options.geoTypical().isSet())
 		{
 			_CDB_geoTypical = _options.geoTypical().value();
@@ -240,7 +308,6 @@ public:
     FeatureCursor* createFeatureCursor( const Symbology::Query& query )
     {
         FeatureCursor* result = 0L;
-		_cur_Feature_Cnt = 0;
 		// Make sure the root directory is set
 		if (!_options.rootDir().isSet())
 		{
@@ -248,6 +315,7 @@ public:
 			return result;
 		}
 		const osgEarth::TileKey key = query.tileKey().get();
+		CDB_Key_Trace::Record(_CDB_geoTypical ? "gt_features" : "gs_features", key.getLOD(), key.getTileX(), key.getTileY());
 		const GeoExtent key_extent = key.getExtent();
 		CDB_Tile_Type tiletype;
 		if (_CDB_geoTypical)
@@ -256,24 +324,196 @@ public:
 			tiletype = GeoSpecificModel;
 		CDB_Tile_Extent tileExtent(key_extent.north(), key_extent.south(), key_extent.east(), key_extent.west());
 
+		CDB_Stats_Timer cursor_timer(CDB_Stat_Feature_Cursor, 0);
 		CDB_Tile *mainTile = new CDB_Tile(_rootString, _cacheDir, tiletype, _dataSet, &tileExtent);
+		cursor_timer.Set_Lod(mainTile->CDB_LOD_Num());
+
+		if ((_CDB_Max_Lod >= 0) && (mainTile->CDB_LOD_Num() > _CDB_Max_Lod))
+		{
+			//Finer than the CDB feature tiles: return the instances of the tile holding the key that lie in the key
+			delete mainTile;
+			return createSubTileCursor(key_extent, tiletype);
+		}
+
+		if (_CDB_Chunk_Size <= 0)
+		{
+			FeatureList features;
+			bool dataOK = readTileFeatures(mainTile, features, key.str());
+			delete mainTile;
 
+			result = dataOK ? new FeatureListCursor( features ) : 0L;
+			return result;
+		}
+
+		//The cursor owns the tile from here and reads the first chunk before it is returned
+		osg::ref_ptr<CDBFeatureCursor> cursor = new CDBFeatureCursor(this, mainTile, key.str(), (size_t)_CDB_Chunk_Size);
+		if (cursor->dataOK())
+			result = cursor.release();
+
+        return result;
+    }
+
+    /**
+    * Gets the Feature with the given FID
+    * @returns
+    *     The Feature with the given FID or NULL if not found.
+    */
+    virtual Feature* getFeature( FeatureID fid )
+    {
+        return 0;
+    }
+
+    virtual bool isWritable() const
+    {
+        return false;
+    }
+
+    virtual const FeatureSchema& getSchema() const
+    {
+        //TODO:  Populate the schema from the DescribeFeatureType call
+        return _schema;
+    }
+
+    virtual osgEarth::Symbology::Geometry::Type getGeometryType() const
+    {
+        return Geometry::TYPE_UNKNOWN;
+    }
+
+private:
+
+	//Hands out the instances of a CDB tile a chunk at a time so the filters can start on the first chunk.
+	//The tile and its shapefiles and archives stay open until the cursor is released.
+	class CDBFeatureCursor : public FeatureCursor
+	{
+	public:
+		CDBFeatureCursor(CDBFeatureSource *source, CDB_Tile *mainTile, const std::string& keyName, size_t chunkSize) :
+			_source(source),
+			_mainTile(mainTile),
+			_keyName(keyName),
+			_chunkSize(chunkSize),
+			_sel(0),
+			_inSelection(false),
+			_dataOK(false)
+		{
+			readChunk();
+		}
+
+		virtual ~CDBFeatureCursor()
+		{
+			//A selection not read to the end leaves its unread models out of the unreferenced list
+			delete _mainTile;
+		}
+
+		bool dataOK() const
+		{
+			return _dataOK;
+		}
+
+		virtual bool hasMore() const
+		{
+			return !_queue.empty();
+		}
+
+		virtual Feature* nextFeature()
+		{
+			if (_queue.empty())
+				return 0L;
+			//Held until the next call, as FeatureListCursor's list holds its features
+			_lastFeature = _queue.front();
+			_queue.pop_front();
+			if (_queue.empty())
+				readChunk();
+			return _lastFeature.get();
+		}
+
+	private:
+		void readChunk()
+		{
+			FeatureList chunk;
+			int Files2check = _mainTile->Model_Sel_Count();
+			while ((chunk.size() < _chunkSize) && (_sel < Files2check))
+			{
+				if (!_inSelection)
+				{
+					bool have_file = _mainTile->Init_Model_Tile(_sel);
+					std::string base = _mainTile->FileName(_sel);
+
+					OE_DEBUG << _keyName << "=" << base << std::endl;
+
+					if (!have_file || Registry::instance()->isBlacklisted(base))
+					{
+						if (!have_file)
+							Registry::instance()->blacklist(base);
+						++_sel;
+						continue;
+					}
+
+					bool fileOk;
+					{
+						OGR_SCOPED_LOCK;
+						fileOk = _source->beginFeatures(_mainTile, base, _sel, _state);
+					}
+					if (!fileOk)
+					{
+						Registry::instance()->blacklist(base);
+						++_sel;
+						continue;
+					}
+					_dataOK = true;
+					_inSelection = true;
+				}
+
+				OGR_SCOPED_LOCK;
+				CDB_Stats_Timer features_timer(CDB_Stat_Get_Features, _mainTile->CDB_LOD_Num());
+				_source->readFeatures(_mainTile, _state, chunk, _chunkSize - chunk.size());
+				if (_state.Done)
+				{
+					_source->endFeatures(_mainTile, _state);
+					_inSelection = false;
+					++_sel;
+				}
+			}
+
+			if (chunk.empty())
+				return;
+			if (_source->_CDB_Clamp_To_Elevation)
+				_source->clampFeatures(chunk, _mainTile->CDB_LOD_Num());
+			_queue.splice(_queue.end(), chunk);
+		}
+
+		osg::ref_ptr<CDBFeatureSource>	_source;
+		CDB_Tile *						_mainTile;
+		std::string						_keyName;
+		size_t							_chunkSize;
+		int								_sel;
+		bool							_inSelection;
+		bool							_dataOK;
+		CDBFeatureReadState				_state;
+		FeatureList						_queue;
+		osg::ref_ptr<Feature>			_lastFeature;
+	};
+
+	//Reads the instances of every selection of the CDB tile
+	bool readTileFeatures(CDB_Tile *mainTile, FeatureList& features, const std::string& keyName)
+	{
 		int Files2check = mainTile->Model_Sel_Count();
 		int FilesChecked = 0;
 		bool dataOK = false;
 
-		FeatureList features;
 		while (FilesChecked < Files2check)
 		{
 			bool have_file = mainTile->Init_Model_Tile(FilesChecked);
 			std::string base = mainTile->FileName(FilesChecked);
 
 
-			OE_DEBUG << query.tileKey().get().str() << "=" << base << std::endl;
+			OE_DEBUG << keyName << "=" << base << std::endl;
 
 			// check the blacklist:
 			if (Registry::instance()->isBlacklisted(base))
+			{
+				++FilesChecked;
 				continue;
+			}
 
 			if (!have_file)
 			{
@@ -296,69 +536,174 @@ public:
 			++FilesChecked;
 		}
 
-		delete mainTile;
+		if (dataOK && _CDB_Clamp_To_Elevation && !features.empty())
+			clampFeatures(features, mainTile->CDB_LOD_Num());
 
-		result = dataOK ? new FeatureListCursor( features ) : 0L;
 
-        return result;
-    }
+		return dataOK;
+	}
 
-    /**
-    * Gets the Feature with the given FID
-    * @returns
-    *     The Feature with the given FID or NULL if not found.
-    */
-    virtual Feature* getFeature( FeatureID fid )
-    {
-        return 0;
-    }
+	FeatureCursor* createSubTileCursor(const GeoExtent& key_extent, CDB_Tile_Type tiletype)
+	{
+		coord2d center;
+		center.Xpos = (key_extent.west() + key_extent.east()) * 0.5;
+		center.Ypos = (key_extent.south() + key_extent.north()) * 0.5;
+		CDB_Tile_Extent tileExtent = CDB_Elevation_Sampler::Tile_Extent(center, _CDB_Max_Lod);
+
+		std::stringstream keybuf;
+		keybuf << std::setprecision(12) << tileExtent.South << "_" << tileExtent.West << "_" << _CDB_Max_Lod;
+		std::string indexKey = keybuf.str();
+
+		//The first key inside the tile builds the index, the others wait for it
+		osg::ref_ptr<CDBFeatureTileIndex> indexRef;
+		bool builder = false;
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_tileIndexMutex);
+			CDBFeatureTileIndexMap::iterator ii = _tileIndices.find(indexKey);
+			if (ii == _tileIndices.end())
+			{
+				indexRef = new CDBFeatureTileIndex;
+				_tileIndices[indexKey] = indexRef;
+				_tileIndexOrder.push_back(indexKey);
+				while ((int)_tileIndexOrder.size() > _CDB_Index_Cache_Size)
+				{
+					_tileIndices.erase(_tileIndexOrder.front());
+					_tileIndexOrder.pop_front();
+				}
+				builder = true;
+			}
+			else
+				indexRef = ii->second;
+		}
 
-    virtual bool isWritable() const
-    {
-        return false;
-    }
+		if (builder)
+		{
+			buildTileIndex(*indexRef, tileExtent, tiletype, indexKey);
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_tileIndexMutex);
+			indexRef->Ready = true;
+			//A failed read is not kept, the waiters give up on it and the next key of the tile reads it again
+			if (!indexRef->DataOK)
+			{
+				CDBFeatureTileIndexMap::iterator ii = _tileIndices.find(indexKey);
+				if ((ii != _tileIndices.end()) && (ii->second == indexRef))
+				{
+					_tileIndices.erase(ii);
+					_tileIndexOrder.remove(indexKey);
+				}
+			}
+			_tileIndexBuilt.broadcast();
+		}
+		else
+		{
+			OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_tileIndexMutex);
+			while (!indexRef->Ready)
+				_tileIndexBuilt.wait(&_tileIndexMutex);
+		}
 
-    virtual const FeatureSchema& getSchema() const
-    {
-        //TODO:  Populate the schema from the DescribeFeatureType call
-        return _schema;
-    }
+		const CDBFeatureTileIndex &index = *indexRef;
+		if (!index.DataOK)
+			return 0L;
 
-    virtual osgEarth::Symbology::Geometry::Type getGeometryType() const
-    {
-        return Geometry::TYPE_UNKNOWN;
-    }
+		//Keys own their west and south edges, the east and north edges only at the edge of the tile
+		FeatureList features;
+		double eps = 1e-9;
+		bool ownEast = key_extent.east() >= tileExtent.East - eps;
+		bool ownNorth = key_extent.north() >= tileExtent.North - eps;
+		double cellWidth = (tileExtent.East - tileExtent.West) / (double)CDB_INDEX_GRID;
+		double cellHeight = (tileExtent.North - tileExtent.South) / (double)CDB_INDEX_GRID;
+		int col0 = osg::clampBetween((int)floor((key_extent.west() - tileExtent.West) / cellWidth), 0, CDB_INDEX_GRID - 1);
+		int col1 = osg::clampBetween((int)floor((key_extent.east() - tileExtent.West) / cellWidth), 0, CDB_INDEX_GRID - 1);
+		int row0 = osg::clampBetween((int)floor((key_extent.south() - tileExtent.South) / cellHeight), 0, CDB_INDEX_GRID - 1);
+		int row1 = osg::clampBetween((int)floor((key_extent.north() - tileExtent.South) / cellHeight), 0, CDB_INDEX_GRID - 1);
+		for (int row = row0; row <= row1; ++row)
+		{
+			for (int col = col0; col <= col1; ++col)
+			{
+				const std::vector<unsigned> &cell = index.Cells[row * CDB_INDEX_GRID + col];
+				for (std::vector<unsigned>::const_iterator ci = cell.begin(); ci != cell.end(); ++ci)
+				{
+					const osg::Vec2d &pos = index.Positions[*ci];
+					if ((pos.x() < key_extent.west()) || (pos.y() < key_extent.south()))
+						continue;
+					if ((ownEast ? (pos.x() > key_extent.east()) : (pos.x() >= key_extent.east())) ||
+						(ownNorth ? (pos.y() > key_extent.north()) : (pos.y() >= key_extent.north())))
+						continue;
+					//The filters and compilers change features in place so each key gets its own copy
+					features.push_back(new Feature(*index.Features[*ci], osg::CopyOp::DEEP_COPY_ALL));
+				}
+			}
+		}
+		return new FeatureListCursor(features);
+	}
 
-private:
+	//Called without the index lock, the index is not Ready until this returns
+	void buildTileIndex(CDBFeatureTileIndex& index, CDB_Tile_Extent& tileExtent, CDB_Tile_Type tiletype, const std::string& indexKey)
+	{
+		index.Cells.resize(CDB_INDEX_GRID * CDB_INDEX_GRID);
+		FeatureList features;
+		CDB_Tile *mainTile = new CDB_Tile(_rootString, _cacheDir, tiletype, _dataSet, &tileExtent);
+		index.DataOK = readTileFeatures(mainTile, features, indexKey);
+		delete mainTile;
+		index.Features.assign(features.begin(), features.end());
 
+		double cellWidth = (tileExtent.East - tileExtent.West) / (double)CDB_INDEX_GRID;
+		double cellHeight = (tileExtent.North - tileExtent.South) / (double)CDB_INDEX_GRID;
+		index.Positions.reserve(index.Features.size());
+		for (unsigned fi = 0; fi < (unsigned)index.Features.size(); ++fi)
+		{
+			Geometry *geom = index.Features[fi]->getGeometry();
+			if (!geom || geom->empty())
+			{
+				index.Positions.push_back(osg::Vec2d(-1000.0, -1000.0));
+				continue;
+			}
+			osg::Vec3d pos = geom->front();
+			index.Positions.push_back(osg::Vec2d(pos.x(), pos.y()));
+			int col = osg::clampBetween((int)floor((pos.x() - tileExtent.West) / cellWidth), 0, CDB_INDEX_GRID - 1);
+			int row = osg::clampBetween((int)floor((pos.y() - tileExtent.South) / cellHeight), 0, CDB_INDEX_GRID - 1);
+			index.Cells[row * CDB_INDEX_GRID + col].push_back(fi);
+		}
+	}
 
+	//Reads all the instances of one selection of the CDB tile
 	bool getFeatures(CDB_Tile *mainTile, const std::string& buffer, FeatureList& features, int sel)
 	{
-		// find the right driver for the given mime type
 		OGR_SCOPED_LOCK;
-		// find the right driver for the given mime type
-		bool have_archive = false;
-		bool have_texture_zipfile = false;
+		CDB_Stats_Timer features_timer(CDB_Stat_Get_Features, mainTile->CDB_LOD_Num());
+		CDBFeatureReadState state;
+		if (!beginFeatures(mainTile, buffer, sel, state))
+			return false;
+		readFeatures(mainTile, state, features, 0);
+		endFeatures(mainTile, state);
+		return true;
+	}
+
+	//Finds the archives of a selection, the OGR lock must be held
+	bool beginFeatures(CDB_Tile *mainTile, const std::string& buffer, int sel, CDBFeatureReadState& state)
+	{
+		state.Sel = sel;
+		state.Buffer = buffer;
+		state.Have_Archive = false;
+		state.Have_Texture_Zipfile = false;
+		state.Done = false;
+		state.Feature_Cnt = 0;
+		state.TileNameStr.clear();
+		state.ModelTextureDir.clear();
+		state.ModelZipFile.clear();
+		state.TextureZipFile.clear();
+		state.ModelZipDir.clear();
 
-		std::string TileNameStr;
 		if (_CDB_Edit_Support)
 		{
-			TileNameStr = osgDB::getSimpleFileName(buffer);
-			TileNameStr = osgDB::getNameLessExtension(TileNameStr);
+			state.TileNameStr = osgDB::getSimpleFileName(buffer);
+			state.TileNameStr = osgDB::getNameLessExtension(state.TileNameStr);
 		}
 
-		const SpatialReference* srs = SpatialReference::create("EPSG:4326");
-
-		osg::ref_ptr<osgDB::Options> localoptions = _dbOptions->cloneOptions();
-		std::string ModelTextureDir = "";
-		std::string ModelZipFile = "";
-		std::string TextureZipFile = "";
-		std::string ModelZipDir = "";
 		if (_CDB_inflated)
 		{
 			if (!_CDB_geoTypical)
 			{
-				if (!mainTile->Model_Texture_Directory(ModelTextureDir))
+				if (!mainTile->Model_Texture_Directory(state.ModelTextureDir))
 					return false;
 			}
 		}
@@ -366,25 +711,51 @@ private:
 		{
 			if (!_CDB_geoTypical)
 			{
-				have_archive = mainTile->Model_Geometry_Name(ModelZipFile);
-				if (!have_archive)
+				state.Have_Archive = mainTile->Model_Geometry_Name(state.ModelZipFile);
+				if (!state.Have_Archive)
 					return false;
-				have_texture_zipfile = mainTile->Model_Texture_Archive(TextureZipFile);
+				state.Have_Texture_Zipfile = mainTile->Model_Texture_Archive(state.TextureZipFile);
 			}
 		}
 		if (_CDB_GS_uses_GTtex)
-			ModelZipDir = mainTile->Model_ZipDir();
+			state.ModelZipDir = mainTile->Model_ZipDir();
+		return true;
+	}
+
+	//Reads up to MaxFeatures instances of the selection (all of them when 0), state.Done is set once the
+	//selection has no more. The OGR lock must be held.
+	void readFeatures(CDB_Tile *mainTile, CDBFeatureReadState& state, FeatureList& features, size_t MaxFeatures)
+	{
+		const std::string &buffer = state.Buffer;
+		int sel = state.Sel;
+		const std::string &TileNameStr = state.TileNameStr;
+		const bool &have_archive = state.Have_Archive;
+		bool &have_texture_zipfile = state.Have_Texture_Zipfile;
+		const std::string &ModelTextureDir = state.ModelTextureDir;
+		std::string &ModelZipFile = state.ModelZipFile;
+		std::string &TextureZipFile = state.TextureZipFile;
+		const std::string &ModelZipDir = state.ModelZipDir;
 
+		const SpatialReference* srs = SpatialReference::create("EPSG:4326");
+
+		//Only the time spent in OGR fetching the features counts as iteration
+		bool time_iterate = CDB_Stats::Is_Enabled();
+		double iterate_secs = 0.0;
 		bool done = false;
-		while (!done)
+		size_t fetched = 0;
+		while (!done && ((MaxFeatures == 0) || (fetched < MaxFeatures)))
 		{
+			++fetched;
 			OGRFeatureH feat_handle;
 			std::string FullModelName;
 			std::string ArchiveFileName;
 			std::string ModelKeyName;
 			bool Model_in_Archive = false;
 			bool valid_model = true;
+			osg::Timer_t iterate_start = time_iterate ? osg::Timer::instance()->tick() : 0;
 			feat_handle = (OGRFeatureH)mainTile->Next_Valid_Feature(sel, _CDB_inflated, ModelKeyName, FullModelName, ArchiveFileName, Model_in_Archive);
+			if (time_iterate)
+				iterate_secs += osg::Timer::instance()->delta_s(iterate_start, osg::Timer::instance()->tick());
 			if (feat_handle == NULL)
 			{
 				done = true;
@@ -407,7 +778,7 @@ private:
 			{
 				std::stringstream format_stream;
 				format_stream << TileNameStr << "_" << std::setfill('0')
-					<< std::setw(5) << abs(_cur_Feature_Cnt);
+					<< std::setw(5) << abs(state.Feature_Cnt);
 
 				f->set("name", ModelKeyName);
 				std::string transformName = "xform_" + format_stream.str();
@@ -421,7 +792,7 @@ private:
 				f->set("tilename", buffer);
 				f->set("selection", sel);
 			}
-			++_cur_Feature_Cnt;
+			++state.Feature_Cnt;
 			if (!_CDB_inflated)
 			{
 				f->set("osge_modelzip", ModelZipFile);
@@ -649,7 +1020,18 @@ private:
 			}
 			OGR_F_Destroy(feat_handle);
 		}
-		if (have_archive)
+		if (done)
+			state.Done = true;
+		if (time_iterate)
+			CDB_Stats::Record(CDB_Stat_OGR_Iterate, mainTile->CDB_LOD_Num(), iterate_secs);
+	}
+
+	//Records the models of the selection's archive that no instance referenced, the OGR lock must be held
+	void endFeatures(CDB_Tile *mainTile, CDBFeatureReadState& state)
+	{
+		const std::string &ModelZipFile = state.ModelZipFile;
+		const std::string &TextureZipFile = state.TextureZipFile;
+		if (state.Have_Archive)
 		{
 			//Verify all models in the archive have been referenced
 			//If not store them in unreferenced
@@ -701,10 +1083,67 @@ private:
 				}
 			}
 		}
-		return true;
 	}
 
+	//Replaces the height of the instances that sit on the ground with the CDB elevation under them,
+	//all the instances of the tile are sampled in one pass. Instances with AHGT set already carry an
+	//absolute height.
+	void clampFeatures(FeatureList& features, int cdbLod)
+	{
+		int lod = (_CDB_Clamp_Lod >= 0) ? _CDB_Clamp_Lod : cdbLod;
+
+		std::vector<Feature *> clamped;
+		std::vector<coord2d> points;
+		for (FeatureList::iterator fi = features.begin(); fi != features.end(); ++fi)
+		{
+			Feature *f = fi->get();
+			if (!f->getGeometry() || isAbsoluteHeight(f))
+				continue;
+			clamped.push_back(f);
+			GeometryIterator gi(f->getGeometry(), false);
+			while (gi.hasMore())
+			{
+				Geometry *part = gi.next();
+				for (Geometry::iterator pi = part->begin(); pi != part->end(); ++pi)
+				{
+					coord2d point;
+					point.Xpos = pi->x();
+					point.Ypos = pi->y();
+					points.push_back(point);
+				}
+			}
+		}
+		if (points.empty())
+			return;
+
+		std::vector<float> heights;
+		CDB_Elevation_Sampler sampler(_rootString, _dataSet);
+		sampler.Sample(points, lod, heights);
+
+		//Same walk as above, points without any CDB elevation keep their height
+		size_t hi = 0;
+		for (std::vector<Feature *>::iterator fi = clamped.begin(); fi != clamped.end(); ++fi)
+		{
+			GeometryIterator gi((*fi)->getGeometry(), false);
+			while (gi.hasMore())
+			{
+				Geometry *part = gi.next();
+				for (Geometry::iterator pi = part->begin(); pi != part->end(); ++pi, ++hi)
+				{
+					if (heights[hi] != NO_DATA_VALUE)
+						pi->z() = (double)heights[hi];
+				}
+			}
+		}
+	}
 
+	bool isAbsoluteHeight(Feature *f)
+	{
+		if (!f->hasAttr("ahgt"))
+			return false;
+		std::string ahgt = f->getString("ahgt");
+		return !ahgt.empty() && ((ahgt[0] == 'T') || (ahgt[0] == 't') || (ahgt[0] == 'Y') || (ahgt[0] == 'y') || (ahgt[0] == '1'));
+	}
 
 	bool validate_name(std::string &filename)
 	{
@@ -741,13 +1180,21 @@ private:
 	bool							_CDB_GS_uses_GTtex;
 	bool							_CDB_No_Second_Ref;
 	bool							_CDB_Edit_Support;
+	bool							_CDB_Clamp_To_Elevation;
+	int								_CDB_Clamp_Lod;
+	int								_CDB_Max_Lod;
+	int								_CDB_Index_Cache_Size;
+	int								_CDB_Chunk_Size;
+	OpenThreads::Mutex				_tileIndexMutex;
+	OpenThreads::Condition			_tileIndexBuilt;
+	CDBFeatureTileIndexMap			_tileIndices;
+	std::list<std::string>			_tileIndexOrder;
     osg::ref_ptr<CacheBin>          _cacheBin;
     osg::ref_ptr<osgDB::Options>    _dbOptions;
 	int								_CDBLodNum;
 	std::string						_rootString;
 	std::string						_cacheDir;
 	std::string						_dataSet;
-	int								_cur_Feature_Cnt;
 };
 
 